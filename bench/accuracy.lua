@@ -0,0 +1,217 @@
+-- how far the dumped self/total percentages are from known costs, one json object per line
+-- usage: LUA_CPATH="luaclib/?.so" lua bench/accuracy.lua [unit_us] [out_dir]
+local profiler = require "profiler.c"
+local busy = require "bench_busy"
+
+-- the unit is kept off multiples of the scheduler tick, otherwise the
+-- sampler phase locks with the scenario loops and always lands on one frame
+local unit = (tonumber(arg[1]) or 1700) * 1000
+local out_dir = arg[2] or "/tmp"
+local modes = {"hook", "vm", "sample"}
+local spin = busy.spin
+
+-- every scenario function only spins for whole units, the truth table gives
+-- the units each spends in its own body (self) and with its callees (total)
+local function leaf_a() spin(unit) end
+local function leaf_b() spin(2 * unit) end
+local function leaf_c() spin(3 * unit) end
+
+local function flat()
+	for _ = 1, 40 do
+		leaf_a()
+		leaf_b()
+		leaf_c()
+	end
+end
+
+local function inner() spin(unit) end
+local function middle() spin(unit) inner() end
+local function outer() spin(2 * unit) middle() end
+
+local function nested()
+	for _ = 1, 60 do
+		outer()
+	end
+end
+
+local function recurse(depth)
+	spin(unit)
+	if depth > 1 then
+		recurse(depth - 1)
+	end
+end
+
+local function recursion()
+	for _ = 1, 30 do
+		recurse(8)
+	end
+end
+
+local function worker()
+	while true do
+		spin(2 * unit)
+		coroutine.yield()
+	end
+end
+
+local function driver(co)
+	spin(unit)
+	coroutine.resume(co)
+end
+
+local function coroutines()
+	local co = coroutine.create(worker)
+	for _ = 1, 80 do
+		driver(co)
+	end
+end
+
+local scenarios = {
+	{name = "flat", run = flat, truth = {
+		[leaf_a] = {self = 40, total = 40},
+		[leaf_b] = {self = 80, total = 80},
+		[leaf_c] = {self = 120, total = 120},
+	}},
+	{name = "nested", run = nested, truth = {
+		[outer] = {self = 120, total = 240},
+		[middle] = {self = 60, total = 120},
+		[inner] = {self = 60, total = 60},
+	}},
+	{name = "recursion", run = recursion, truth = {
+		[recurse] = {self = 240, total = 240},
+	}},
+	{name = "coroutine", run = coroutines, truth = {
+		[driver] = {self = 80, total = 80},
+		[worker] = {self = 160, total = 160},
+	}},
+}
+
+-- the dump is json with single quotes and trailing commas
+local function parse(text)
+	local pos = 1
+	local value
+
+	local function skip()
+		pos = text:find("[^%s,]", pos) or #text + 1
+	end
+
+	local function object()
+		local t = {}
+		pos = pos + 1
+		skip()
+		while text:sub(pos, pos) ~= "}" do
+			local key = text:match("^'([^']*)'", pos)
+			pos = pos + #key + 3
+			t[key] = value()
+			skip()
+		end
+		pos = pos + 1
+		return t
+	end
+
+	local function array()
+		local t = {}
+		pos = pos + 1
+		skip()
+		while text:sub(pos, pos) ~= "]" do
+			t[#t + 1] = value()
+			skip()
+		end
+		pos = pos + 1
+		return t
+	end
+
+	value = function()
+		skip()
+		local c = text:sub(pos, pos)
+		if c == "{" then
+			return object()
+		elseif c == "[" then
+			return array()
+		elseif c == "'" then
+			local s = text:match("^'([^']*)'", pos)
+			pos = pos + #s + 2
+			return s
+		end
+		local n = text:match("^[-%d.eE+]+", pos)
+		pos = pos + #n
+		return tonumber(n)
+	end
+
+	return value()
+end
+
+-- self counts spin callees as part of the caller, total skips nested
+-- recursive nodes so they are not counted twice
+local function collect(node, lines, result, active)
+	local line = tonumber(node.call:match(":(%-?%d+)$"))
+	local key = lines[line]
+	local self = node.self or 0
+	for _, child in ipairs(node.subcall or {}) do
+		if child.call:find("spin") then
+			self = self + child.total
+		end
+	end
+
+	if key then
+		local r = result[key]
+		r.self = r.self + self
+		if not active[key] then
+			r.total = r.total + node.total
+		end
+	end
+
+	local was_active = key and active[key]
+	if key then
+		active[key] = true
+	end
+	for _, child in ipairs(node.subcall or {}) do
+		collect(child, lines, result, active)
+	end
+	if key then
+		active[key] = was_active
+	end
+end
+
+for _, scenario in ipairs(scenarios) do
+	local lines, names, units = {}, {}, 0
+	for f, truth in pairs(scenario.truth) do
+		local info = debug.getinfo(f, "S")
+		lines[info.linedefined] = f
+		names[f] = "line" .. info.linedefined
+		units = units + truth.self
+	end
+
+	for _, mode in ipairs(modes) do
+		local file = string.format("%s/accuracy_%s_%s.json", out_dir, scenario.name, mode)
+		profiler.start{mode = mode, hz = 1000}
+		scenario.run()
+		profiler.dump(file)
+		profiler.stop()
+
+		local fp = io.open(file)
+		local root = parse(fp:read("a"))
+		fp:close()
+
+		local result = {}
+		for f in pairs(scenario.truth) do
+			result[f] = {self = 0, total = 0}
+		end
+		collect(root, lines, result, {})
+
+		local self_error, total_error, count = 0, 0, 0
+		for f, truth in pairs(scenario.truth) do
+			local self_per = result[f].self / root.total * 100
+			local total_per = result[f].total / root.total * 100
+			local self_err = math.abs(self_per - truth.self / units * 100)
+			local total_err = math.abs(total_per - truth.total / units * 100)
+			print(string.format('{"scenario":"%s","mode":"%s","function":"%s","self_expect":%.3f,"self":%.3f,"total_expect":%.3f,"total":%.3f,"self_error":%.3f,"total_error":%.3f}',
+				scenario.name, mode, names[f], truth.self / units * 100, self_per, truth.total / units * 100, total_per, self_err, total_err))
+			self_error = self_error + self_err
+			total_error = total_error + total_err
+			count = count + 1
+		end
+		print(string.format('{"scenario":"%s","mode":"%s","function":"*","mean_self_error":%.3f,"mean_total_error":%.3f}',
+			scenario.name, mode, self_error / count, total_error / count))
+	end
+end
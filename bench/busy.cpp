@@ -0,0 +1,30 @@
+#include <lua.hpp>
+
+#include "clocks.h"
+
+// busy work of known cost for the accuracy benchmark, spins on the thread
+// cpu clock so preemption does not shorten the work that gets done.
+// exported so sample mode can name it through dladdr
+extern "C" int bench_busy_spin(lua_State *L) {
+	uint64_t ns = (uint64_t)luaL_checkinteger(L, 1);
+	uint64_t start = GetClockTime(CLOCK_THREAD_CPUTIME_ID);
+	uint64_t now = start;
+	while (now - start < ns) {
+		now = GetClockTime(CLOCK_THREAD_CPUTIME_ID);
+	}
+
+	lua_pushinteger(L, (lua_Integer)(now - start));
+	return 1;
+}
+
+extern "C"
+int luaopen_bench_busy(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{"spin", bench_busy_spin},
+		{NULL, NULL}
+	};
+
+	luaL_newlib(L, l);
+	return 1;
+}
@@ -0,0 +1,172 @@
+-- profiler overhead per workload and mode, one json object per line
+-- usage: LUA_CPATH="luaclib/?.so" lua bench/overhead.lua [rounds] [scale]
+local profiler = require "profiler.c"
+
+local rounds = tonumber(arg[1]) or 5
+local scale = tonumber(arg[2]) or 1
+
+-- gc is on by default, so rows leave it off unless they measure it; rows that
+-- measure gc or the allocator run with the collector on and are compared with
+-- "off+collect", the rest with "off"
+local configs = {
+	{label = "off"},
+	{label = "hook", mode = "hook"},
+	{label = "vm", mode = "vm"},
+	{label = "sample", mode = "sample"},
+	{label = "hook+line", mode = "hook", line = true},
+	{label = "vm+line", mode = "vm", line = true},
+	{label = "off+collect", collect = true},
+	{label = "hook+gc", mode = "hook", gc = true, collect = true},
+	{label = "vm+gc", mode = "vm", gc = true, collect = true},
+	{label = "hook+alloc", mode = "hook", alloc = true, collect = true},
+	{label = "vm+alloc", mode = "vm", alloc = true, collect = true},
+	{label = "vm+alloc_sample_kb", mode = "vm", alloc_sample_kb = 64, collect = true},
+}
+
+-- every workload returns the number of function calls it made, lua and C,
+-- as the hooks see them
+local function fib(n)
+	if n < 2 then
+		return n
+	end
+	return fib(n - 1) + fib(n - 2)
+end
+
+local function fib_calls(n)
+	local a, b = 1, 1
+	for _ = 2, n do
+		a, b = b, a + b + 1
+	end
+	return b
+end
+
+local function make_pair(i)
+	return {i, i * 2}
+end
+
+local function pair_sum(t)
+	return t[1] + t[2]
+end
+
+local function format_item(i)
+	return string.format("%d:%d", i, i * 3)
+end
+
+local function thrower(i)
+	error(i)
+end
+
+local workloads = {
+	{
+		name = "fib",
+		run = function()
+			local n = 27 + math.floor(math.log(scale, 1.618))
+			fib(n)
+			return fib_calls(n)
+		end,
+	},
+	{
+		name = "table",
+		run = function()
+			local n = 200000 * scale
+			local t = {}
+			for i = 1, n do
+				t[i] = make_pair(i)
+			end
+			local sum = 0
+			for i = 1, n do
+				sum = sum + pair_sum(t[i])
+			end
+			return n * 2
+		end,
+	},
+	{
+		name = "string",
+		run = function()
+			local n = 100000 * scale
+			local parts = {}
+			for i = 1, n do
+				parts[#parts + 1] = format_item(i)
+			end
+			table.concat(parts, ",")
+			return n * 2 + 1
+		end,
+	},
+	{
+		name = "closure",
+		run = function()
+			local n = 200000 * scale
+			local sum = 0
+			for i = 1, n do
+				local add = function(x) return x + i end
+				sum = add(sum)
+			end
+			return n
+		end,
+	},
+	{
+		name = "coroutine",
+		run = function()
+			local n = 100000 * scale
+			local co = coroutine.create(function()
+				while true do
+					coroutine.yield()
+				end
+			end)
+			for _ = 1, n do
+				coroutine.resume(co)
+			end
+			return n * 2
+		end,
+	},
+	{
+		name = "pcall",
+		run = function()
+			local n = 50000 * scale
+			for i = 1, n do
+				pcall(thrower, i)
+			end
+			return n * 3
+		end,
+	},
+}
+
+local function measure(workload, config)
+	local best, calls = math.huge, 0
+	for _ = 1, rounds do
+		if config.mode then
+			profiler.start{mode = config.mode, gc = config.gc or false, alloc = config.alloc,
+				alloc_sample_kb = config.alloc_sample_kb, line = config.line}
+		end
+		-- the collector would add noise unrelated to the profiler
+		collectgarbage()
+		if not config.collect then
+			collectgarbage("stop")
+		end
+		local start = os.clock()
+		calls = workload.run()
+		local elapse = os.clock() - start
+		collectgarbage("restart")
+		if config.mode then
+			profiler.stop()
+		end
+		best = math.min(best, elapse)
+	end
+	return best, calls
+end
+
+for _, workload in ipairs(workloads) do
+	workload.run()
+	local base, collect_base
+	for _, config in ipairs(configs) do
+		local elapse, calls = measure(workload, config)
+		if config.collect then
+			collect_base = collect_base or elapse
+		else
+			base = base or elapse
+		end
+		local against = config.collect and collect_base or base
+		print(string.format('{"workload":"%s","mode":"%s","calls":%d,"seconds":%.6f,"ns_per_call":%.2f,"overhead_ns_per_call":%.2f,"slowdown":%.3f}',
+			workload.name, config.label, calls, elapse, elapse / calls * 1e9, (elapse - against) / calls * 1e9, elapse / against))
+	end
+end
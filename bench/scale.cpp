@@ -0,0 +1,157 @@
+// cost of the snapshot and dump path on large synthetic call trees, one json object per line
+// usage: bench/scale [nodes] [snapshots] [windows] [functions]
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "record_tree.h"
+#include "clocks.h"
+
+using namespace std;
+
+static const int kDefaultNodes = 200000;
+static const int kDefaultSnapshots = 1000;
+static const int kDefaultWindows = 20;
+static const int kDefaultFunctions = 2000;
+static const int kTouchPercent = 1;	// records that change between two snapshots
+static const int kStride = 16;
+static const int kKeyframe = 32;
+
+typedef vector<FunctionInfo *> FunctionInfoList;
+typedef vector<Record *> RecordList;
+
+// deterministic so runs stay comparable
+struct Random {
+	uint64_t state_;
+
+	Random(uint64_t _seed) : state_(_seed) {}
+
+	inline uint64_t Next(void) {
+		state_ ^= state_ << 13;
+		state_ ^= state_ >> 7;
+		state_ ^= state_ << 17;
+		return state_;
+	}
+
+	inline size_t Below(size_t _count) {
+		return (size_t)(Next() % _count);
+	}
+};
+
+static inline uint64_t Now(void) {
+	return GetClockTime(CLOCK_MONOTONIC_RAW);
+}
+
+static void Report(const char *_phase, int _nodes, int _snapshots, int _count, uint64_t _elapse) {
+	printf("{\"phase\":\"%s\",\"nodes\":%d,\"snapshots\":%d,\"count\":%d,\"seconds\":%.6f,\"ns_per_op\":%.1f}\n",
+		_phase, _nodes, _snapshots, _count, _elapse / 1e9, _count > 0 ? (double)_elapse / _count : 0);
+	fflush(stdout);
+}
+
+static void Touch(RecordList &_records, Random &_random) {
+	Record *record = _records[_random.Below(_records.size())];
+	record->AddCount();
+	record->AddInnerElapse(_random.Below(100000));
+}
+
+int main(int argc, char *argv[]) {
+	int nodes = argc > 1 ? atoi(argv[1]) : kDefaultNodes;
+	int snapshots = argc > 2 ? atoi(argv[2]) : kDefaultSnapshots;
+	int windows = argc > 3 ? atoi(argv[3]) : kDefaultWindows;
+	int functions = argc > 4 ? atoi(argv[4]) : kDefaultFunctions;
+	if (nodes < 2 || snapshots < 2 || windows < 1 || functions < 1) {
+		fprintf(stderr, "usage: %s [nodes] [snapshots] [windows] [functions]\n", argv[0]);
+		return 1;
+	}
+
+	// the kernel DiffColumn picked for this cpu, it decides the diff phase
+	printf("{\"diff_column\":\"%s\"}\n", DiffColumnIsa());
+
+	Random random(88172645463325252ULL);
+	FunctionInfoList func_infos;
+	char name[32];
+	for (int i = 0; i < functions; ++i) {
+		snprintf(name, sizeof(name), "f%d", i);
+		func_infos.push_back(new FunctionInfo(name, "@bench/scale.lua", i + 1));
+	}
+
+	// random recursive tree: each new node hangs under any existing one
+	RecordTree *tree = new RecordTree(snapshots, kStride, snapshots, kKeyframe, kRecordCoreColumns, 1.0);
+	RecordList records;
+	records.push_back(tree->Root());
+	uint64_t start = Now();
+	while (tree->Size() < (size_t)nodes) {
+		Record *parent = records[random.Below(records.size())];
+		size_t count = tree->Size();
+		Record *record = tree->GetChildRecord(parent, func_infos[random.Below(func_infos.size())]);
+		if (tree->Size() != count) {
+			records.push_back(record);
+		}
+	}
+	for (size_t i = 1; i < records.size(); ++i) {
+		records[i]->AddCount();
+		records[i]->AddInnerElapse(random.Below(1000000));
+	}
+	Report("build", nodes, snapshots, nodes, Now() - start);
+
+	int touch = nodes * kTouchPercent / 100 + 1;
+	uint64_t elapse = 0;
+	for (int i = 0; i < snapshots; ++i) {
+		for (int j = 0; j < touch; ++j) {
+			Touch(records, random);
+		}
+		start = Now();
+		tree->Save(i, NULL);
+		elapse += Now() - start;
+	}
+	Report("save", nodes, snapshots, snapshots, elapse);
+
+	// windows of random width, the end snapshot is always after the start one
+	const RecordTree::RecordRing &ring = tree->Snapshots();
+	uint64_t load_elapse = 0;
+	uint64_t diff_elapse = 0;
+	uint64_t sort_elapse = 0;
+	uint64_t total = 0;
+	for (int i = 0; i < windows; ++i) {
+		size_t first = random.Below(ring.Size() - 1);
+		size_t last = first + 1 + random.Below(ring.Size() - first - 1);
+
+		start = Now();
+		const RecordCopy *start_record = tree->StartSnapshot(ring.At(first).seq_);
+		const RecordCopy *end_record = tree->EndSnapshot(ring.At(last).seq_);
+		load_elapse += Now() - start;
+
+		start = Now();
+		total = tree->Aggregate(start_record, end_record);
+		diff_elapse += Now() - start;
+
+		start = Now();
+		tree->SortRecords();
+		sort_elapse += Now() - start;
+	}
+	Report("load", nodes, snapshots, windows, load_elapse);
+	Report("diff", nodes, snapshots, windows, diff_elapse);
+	Report("sort", nodes, snapshots, windows, sort_elapse);
+
+	FILE *fp = fopen("/dev/null", "w");
+	if (!fp) {
+		fprintf(stderr, "/dev/null open error\n");
+		return 1;
+	}
+
+	start = Now();
+	for (int i = 0; i < windows; ++i) {
+		fprintf(fp, "{");
+		tree->Data2Json(fp, total > 0 ? (double)total : 1, kRootRecordId);
+		fprintf(fp, "}");
+		fflush(fp);
+	}
+	Report("dump", nodes, snapshots, windows, Now() - start);
+	fclose(fp);
+
+	delete tree;
+	for (FunctionInfoList::const_iterator citr = func_infos.begin(); citr != func_infos.end(); ++citr) {
+		delete *citr;
+	}
+	return 0;
+}
@@ -92,6 +92,24 @@ LUA_API void lua_sethook (lua_State *L, lua_Hook func, int mask, int count) {
 }
 
 
+LUA_API void lua_setprofcall (lua_State *L, lua_ProfCall func, void *ud) {
+  G(L)->profud = ud;
+  G(L)->profcall = func;
+}
+
+
+LUA_API void lua_setthreadcall (lua_State *L, lua_ThreadCall func, void *ud) {
+  G(L)->threadud = ud;
+  G(L)->threadcall = func;
+}
+
+
+LUA_API void lua_setgccall (lua_State *L, lua_GcCall func, void *ud) {
+  G(L)->gcud = ud;
+  G(L)->gccall = func;
+}
+
+
 LUA_API lua_Hook lua_gethook (lua_State *L) {
   return L->hook;
 }
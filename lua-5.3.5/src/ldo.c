@@ -290,6 +290,38 @@ static void callhook (lua_State *L, CallInfo *ci) {
 }
 
 
+/*
+** Report a call/return to the profiler callback, bypassing 'luaD_hook'.
+** A tail call is reported at the depth of the frame it replaces.
+*/
+static void profcall (lua_State *L, CallInfo *ci, int event) {
+  global_State *g = G(L);
+  const TValue *func = ci->func;
+  const void *f;
+  const Proto *p = NULL;
+  int depth = ci->depth;
+  switch (ttype(func)) {
+    case LUA_TLCL:
+      f = clLvalue(func);
+      p = clLvalue(func)->p;
+      break;
+    case LUA_TCCL:
+      f = cast(void *, cast(size_t, clCvalue(func)->f));
+      break;
+    default:
+      f = cast(void *, cast(size_t, fvalue(func)));
+      break;
+  }
+  if (event == LUA_HOOKCALL && p != NULL && isLua(ci->previous) &&
+      GET_OPCODE(*(ci->previous->u.l.savedpc - 1)) == OP_TAILCALL) {
+    ci->callstatus |= CIST_TAIL;
+    event = LUA_HOOKTAILCALL;
+    depth = ci->previous->depth;
+  }
+  (*g->profcall)(L, event, f, p, depth, g->profud);
+}
+
+
 static StkId adjust_varargs (lua_State *L, Proto *p, int actual) {
   int i;
   int nfixargs = p->numparams;
@@ -376,6 +408,8 @@ static int moveresults (lua_State *L, const TValue *firstResult, StkId res,
 int luaD_poscall (lua_State *L, CallInfo *ci, StkId firstResult, int nres) {
   StkId res;
   int wanted = ci->nresults;
+  if (G(L)->profcall)
+    profcall(L, ci, LUA_HOOKRET);
   if (L->hookmask & (LUA_MASKRET | LUA_MASKLINE)) {
     if (L->hookmask & LUA_MASKRET) {
       ptrdiff_t fr = savestack(L, firstResult);  /* hook may change stack */
@@ -428,6 +462,8 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
       ci->top = L->top + LUA_MINSTACK;
       lua_assert(ci->top <= L->stack_last);
       ci->callstatus = 0;
+      if (G(L)->profcall)
+        profcall(L, ci, LUA_HOOKCALL);
       if (L->hookmask & LUA_MASKCALL)
         luaD_hook(L, LUA_HOOKCALL, -1);
       lua_unlock(L);
@@ -458,6 +494,8 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
       lua_assert(ci->top <= L->stack_last);
       ci->u.l.savedpc = p->code;  /* starting point */
       ci->callstatus = CIST_LUA;
+      if (G(L)->profcall)
+        profcall(L, ci, LUA_HOOKCALL);
       if (L->hookmask & LUA_MASKCALL)
         callhook(L, ci);
       return 0;
@@ -648,6 +686,7 @@ static void resume (lua_State *L, void *ud) {
 LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   int status;
   unsigned short oldnny = L->nny;  /* save "number of non-yieldable" calls */
+  lua_State *oldrunning = G(L)->running;  /* save running thread */
   lua_lock(L);
   if (L->status == LUA_OK) {  /* may be starting a coroutine */
     if (L->ci != &L->base_ci)  /* not in base level? */
@@ -661,6 +700,7 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   luai_userstateresume(L, nargs);
   L->nny = 0;  /* allow yields */
   api_checknelems(L, (L->status == LUA_OK) ? nargs + 1 : nargs);
+  G(L)->running = L;
   status = luaD_rawrunprotected(L, resume, &nargs);
   if (status == -1)  /* error calling 'lua_resume'? */
     status = LUA_ERRRUN;
@@ -676,6 +716,7 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
     }
     else lua_assert(status == L->status);  /* normal end or yield */
   }
+  G(L)->running = oldrunning;  /* restore running thread */
   L->nny = oldnny;  /* restore 'nny' */
   L->nCcalls--;
   lua_assert(L->nCcalls == ((from) ? from->nCcalls : 0));
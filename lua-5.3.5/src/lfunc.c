@@ -118,6 +118,8 @@ Proto *luaF_newproto (lua_State *L) {
   f->linedefined = 0;
   f->lastlinedefined = 0;
   f->source = NULL;
+  f->profdata = NULL;
+  f->profmark = 0;
   return f;
 }
 
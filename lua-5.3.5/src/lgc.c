@@ -804,6 +804,25 @@ static void dothecall (lua_State *L, void *ud) {
 }
 
 
+/*
+** Report collector work to the profiler callback, with the phase the
+** current 'gcstate' belongs to.
+*/
+static void gccall (lua_State *L, int event) {
+  global_State *g = G(L);
+  int phase;
+  if (g->gccall == NULL)
+    return;
+  switch (g->gcstate) {
+    case GCSatomic: phase = LUA_GCPHASEATOMIC; break;
+    case GCScallfin: phase = LUA_GCPHASECALLFIN; break;
+    case GCSpropagate: case GCSpause: phase = LUA_GCPHASEPROPAGATE; break;
+    default: phase = LUA_GCPHASESWEEP; break;
+  }
+  (*g->gccall)(L, event, phase, g->gcud);
+}
+
+
 static void GCTM (lua_State *L, int propagateerrors) {
   global_State *g = G(L);
   const TValue *tm;
@@ -820,7 +839,9 @@ static void GCTM (lua_State *L, int propagateerrors) {
     setobj2s(L, L->top + 1, &v);  /* ... and its argument */
     L->top += 2;  /* and (next line) call the finalizer */
     L->ci->callstatus |= CIST_FIN;  /* will run a finalizer */
+    gccall(L, LUA_GCTMBEGIN);
     status = luaD_pcall(L, dothecall, NULL, savestack(L, L->top - 2), 0);
+    gccall(L, LUA_GCTMEND);
     L->ci->callstatus &= ~CIST_FIN;  /* not running a finalizer anymore */
     L->allowhook = oldah;  /* restore hooks */
     g->gcrunning = running;  /* restore state */
@@ -1044,6 +1065,7 @@ static lu_mem sweepstep (lua_State *L, global_State *g,
 
 static lu_mem singlestep (lua_State *L) {
   global_State *g = G(L);
+  gccall(L, LUA_GCPHASE);
   switch (g->gcstate) {
     case GCSpause: {
       g->GCmemtrav = g->strt.size * sizeof(GCObject*);
@@ -1133,6 +1155,7 @@ void luaC_step (lua_State *L) {
     luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
     return;
   }
+  gccall(L, LUA_GCSTEPBEGIN);
   do {  /* repeat until pause or enough "credit" (negative debt) */
     lu_mem work = singlestep(L);  /* perform one single step */
     debt -= work;
@@ -1144,6 +1167,7 @@ void luaC_step (lua_State *L) {
     luaE_setdebt(g, debt);
     runafewfinalizers(L);
   }
+  gccall(L, LUA_GCSTEPEND);
 }
 
 
@@ -1159,6 +1183,7 @@ void luaC_step (lua_State *L) {
 void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
   lua_assert(g->gckind == KGC_NORMAL);
+  gccall(L, LUA_GCFULLBEGIN);
   if (isemergency) g->gckind = KGC_EMERGENCY;  /* set flag */
   if (keepinvariant(g)) {  /* black objects? */
     entersweep(L); /* sweep everything to turn them back to white */
@@ -1172,6 +1197,7 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   luaC_runtilstate(L, bitmask(GCSpause));  /* finish collection */
   g->gckind = KGC_NORMAL;
   setpause(g);
+  gccall(L, LUA_GCFULLEND);
 }
 
 /* }====================================================== */
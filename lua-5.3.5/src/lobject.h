@@ -426,6 +426,8 @@ typedef struct Proto {
   struct LClosure *cache;  /* last-created closure with this prototype */
   TString  *source;  /* used for debug information */
   GCObject *gclist;
+  void *profdata;  /* left to profilers, NULL in a new prototype */
+  unsigned int profmark;  /* tells which profiler run set 'profdata' */
 } Proto;
 
 
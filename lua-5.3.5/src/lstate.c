@@ -7,6 +7,9 @@
 #define lstate_c
 #define LUA_CORE
 
+#define luai_userstatethread(L,L1)	threadcall(L, L1, LUA_THREADNEW)
+#define luai_userstatefree(L,L1)	threadcall(L, L1, LUA_THREADFREE)
+
 #include "lprefix.h"
 
 
@@ -111,6 +114,7 @@ CallInfo *luaE_extendCI (lua_State *L) {
   L->ci->next = ci;
   ci->previous = L->ci;
   ci->next = NULL;
+  ci->depth = L->ci->depth + 1;
   L->nci++;
   return ci;
 }
@@ -143,8 +147,11 @@ void luaE_shrinkCI (lua_State *L) {
     L->nci--;
     ci->next = next2;  /* remove 'next' from the list */
     next2->previous = ci;
+    next2->depth = ci->depth + 1;  /* keep depths contiguous */
     ci = next2;  /* keep next's next */
   }
+  if (ci->next != NULL)  /* odd one left at the end? */
+    ci->next->depth = ci->depth + 1;
 }
 
 
@@ -161,6 +168,7 @@ static void stack_init (lua_State *L1, lua_State *L) {
   ci = &L1->base_ci;
   ci->next = ci->previous = NULL;
   ci->callstatus = 0;
+  ci->depth = 0;
   ci->func = L1->top;
   setnilvalue(L1->top++);  /* 'function' entry for this 'ci' */
   ci->top = L1->top + LUA_MINSTACK;
@@ -252,6 +260,13 @@ static void close_state (lua_State *L) {
 }
 
 
+static void threadcall (lua_State *L, lua_State *L1, int event) {
+  global_State *g = G(L);
+  if (g->threadcall)
+    (*g->threadcall)(L, L1, event, g->threadud);
+}
+
+
 LUA_API lua_State *lua_newthread (lua_State *L) {
   global_State *g = G(L);
   lua_State *L1;
@@ -305,9 +320,11 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->currentwhite = bitmask(WHITE0BIT);
   L->marked = luaC_white(g);
   preinit_thread(L, g);
+  memset(lua_getextraspace(L), 0, LUA_EXTRASPACE);  /* copied by threads */
   g->frealloc = f;
   g->ud = ud;
   g->mainthread = L;
+  g->running = L;
   g->seed = makeseed(L);
   g->gcrunning = 0;  /* no GC while building state */
   g->GCestimate = 0;
@@ -315,6 +332,12 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->strt.hash = NULL;
   setnilvalue(&g->l_registry);
   g->panic = NULL;
+  g->profcall = NULL;
+  g->profud = NULL;
+  g->threadcall = NULL;
+  g->threadud = NULL;
+  g->gccall = NULL;
+  g->gcud = NULL;
   g->version = NULL;
   g->gcstate = GCSpause;
   g->gckind = KGC_NORMAL;
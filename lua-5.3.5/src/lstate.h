@@ -107,6 +107,8 @@ typedef struct CallInfo {
   ptrdiff_t extra;
   short nresults;  /* expected number of results from this function */
   unsigned short callstatus;
+  int depth;  /* number of entries before this one in the 'ci' list, kept by
+                 'luaE_extendCI' and renumbered by 'luaE_shrinkCI' */
 } CallInfo;
 
 
@@ -163,7 +165,14 @@ typedef struct global_State {
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC 'granularity' */
   lua_CFunction panic;  /* to be called in unprotected errors */
+  lua_ProfCall profcall;  /* raw call/return callback (see 'lua_setprofcall') */
+  void *profud;  /* auxiliary data to 'profcall' */
+  lua_ThreadCall threadcall;  /* thread callback (see 'lua_setthreadcall') */
+  void *threadud;  /* auxiliary data to 'threadcall' */
+  lua_GcCall gccall;  /* collector callback (see 'lua_setgccall') */
+  void *gcud;  /* auxiliary data to 'gccall' */
   struct lua_State *mainthread;
+  struct lua_State *running;  /* thread currently running (for profilers) */
   const lua_Number *version;  /* pointer to version number */
   TString *memerrmsg;  /* memory-error message */
   TString *tmname[TM_N];  /* array with tag-method names */
@@ -420,6 +420,48 @@ typedef struct lua_Debug lua_Debug;  /* activation record */
 /* Functions to be called by the debugger in specific events */
 typedef void (*lua_Hook) (lua_State *L, lua_Debug *ar);
 
+/*
+** Raw call/return notification for profilers. Called straight from
+** 'luaD_precall'/'luaD_poscall' with the function (the closure, or the
+** lua_CFunction for C functions), its prototype (NULL for C functions)
+** and the depth of its frame; it must not call Lua or push values on
+** the stack.
+*/
+typedef void (*lua_ProfCall) (lua_State *L, int event, const void *func,
+                              const void *proto, int depth, void *ud);
+
+/*
+** Thread lifetime notification for profilers: 'L1' was just created
+** (LUA_THREADNEW) or is about to be freed (LUA_THREADFREE). It may run
+** inside the collector; it must not call Lua.
+*/
+#define LUA_THREADNEW	0
+#define LUA_THREADFREE	1
+
+typedef void (*lua_ThreadCall) (lua_State *L, lua_State *L1, int event,
+                                void *ud);
+
+/*
+** Collector notification for profilers: begin/end pairs bracket each
+** incremental step, each full collection and each finalizer call, and
+** LUA_GCPHASE comes before every unit of collector work with the phase
+** it is done in. It runs inside the collector; it must not call Lua.
+*/
+#define LUA_GCSTEPBEGIN	0
+#define LUA_GCSTEPEND	1
+#define LUA_GCFULLBEGIN	2
+#define LUA_GCFULLEND	3
+#define LUA_GCTMBEGIN	4
+#define LUA_GCTMEND	5
+#define LUA_GCPHASE	6
+
+#define LUA_GCPHASEPROPAGATE	0
+#define LUA_GCPHASEATOMIC	1
+#define LUA_GCPHASESWEEP	2
+#define LUA_GCPHASECALLFIN	3
+
+typedef void (*lua_GcCall) (lua_State *L, int event, int phase, void *ud);
+
 
 LUA_API int (lua_getstack) (lua_State *L, int level, lua_Debug *ar);
 LUA_API int (lua_getinfo) (lua_State *L, const char *what, lua_Debug *ar);
@@ -437,6 +479,10 @@ LUA_API lua_Hook (lua_gethook) (lua_State *L);
 LUA_API int (lua_gethookmask) (lua_State *L);
 LUA_API int (lua_gethookcount) (lua_State *L);
 
+LUA_API void (lua_setprofcall) (lua_State *L, lua_ProfCall func, void *ud);
+LUA_API void (lua_setthreadcall) (lua_State *L, lua_ThreadCall func, void *ud);
+LUA_API void (lua_setgccall) (lua_State *L, lua_GcCall func, void *ud);
+
 
 struct lua_Debug {
   int event;
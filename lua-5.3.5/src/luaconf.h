@@ -736,8 +736,9 @@
 @@ LUA_EXTRASPACE defines the size of a raw memory area associated with
 ** a Lua state with very fast access.
 ** CHANGE it if you need a different size.
+** (four pointers: the profiler keeps its per-thread context there)
 */
-#define LUA_EXTRASPACE		(sizeof(void *))
+#define LUA_EXTRASPACE		(4 * sizeof(void *))
 
 
 /*
@@ -0,0 +1,99 @@
+#include <string.h>
+
+#include "clocks.h"
+
+#ifdef CLOCK_HAS_TSC
+#include <cpuid.h>
+#endif
+
+static const uint64_t kCalibrateNs = 20000000;
+static const char *kClockSourceNames[kClockSourceCount] = {"tsc", "monotonic_raw", "thread_cpu"};
+
+// cpuid 0x80000007 edx bit 8: the tsc ticks at a constant rate in every P/C state
+bool ClockTscInvariant(void) {
+#ifdef CLOCK_HAS_TSC
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid_max(0x80000000, NULL) < 0x80000007) {
+		return false;
+	}
+
+	__cpuid(0x80000007, eax, ebx, ecx, edx);
+	return (edx & (1 << 8)) != 0;
+#else
+	return false;
+#endif
+}
+
+static uint64_t CalibrateTscHz(void) {
+#ifndef CLOCK_HAS_TSC
+	// GetTscTime falls back to nanoseconds
+	return 1000000000;
+#else
+	// leaf 0x15 gives the exact ratio to the crystal when the crystal is enumerated
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid_max(0, NULL) >= 0x15) {
+		__cpuid(0x15, eax, ebx, ecx, edx);
+		if (eax != 0 && ebx != 0 && ecx != 0) {
+			return (uint64_t)ecx * ebx / eax;
+		}
+	}
+
+	// otherwise measure it against the raw monotonic clock
+	uint64_t start_ns = GetClockTime(CLOCK_MONOTONIC_RAW);
+	uint64_t start_tick = GetTscTime();
+	uint64_t end_ns = start_ns;
+	while (end_ns - start_ns < kCalibrateNs) {
+		end_ns = GetClockTime(CLOCK_MONOTONIC_RAW);
+	}
+	uint64_t end_tick = GetTscTime();
+
+	return (uint64_t)((double)(end_tick - start_tick) * 1e9 / (end_ns - start_ns));
+#endif
+}
+
+uint64_t ClockTscHz(void) {
+	static uint64_t tsc_hz = CalibrateTscHz();
+	return tsc_hz;
+}
+
+ClockSource ClockDefaultSource(void) {
+	return ClockTscInvariant() ? kClockSourceTsc : kClockSourceMonotonicRaw;
+}
+
+const char *ClockSourceName(ClockSource _source) {
+	return _source < kClockSourceCount ? kClockSourceNames[_source] : "?";
+}
+
+bool ClockSourceByName(const char *_name, ClockSource *_source) {
+	for (int i = 0; i < kClockSourceCount; ++i) {
+		if (strcmp(_name, kClockSourceNames[i]) == 0) {
+			*_source = (ClockSource)i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+double ClockNsPerTick(ClockSource _source) {
+	return _source == kClockSourceTsc ? 1e9 / ClockTscHz() : 1.0;
+}
+
+void ClockBench(ClockSource _source, int _count, ClockBenchResult *_result) {
+	double ns_per_tick = ClockNsPerTick(_source);
+	uint64_t resolution = UINT64_MAX;
+
+	uint64_t start_ns = GetClockTime(CLOCK_MONOTONIC_RAW);
+	uint64_t last = GetSourceTime(_source);
+	for (int i = 0; i < _count; ++i) {
+		uint64_t curr = GetSourceTime(_source);
+		if (curr > last && curr - last < resolution) {
+			resolution = curr - last;
+		}
+		last = curr;
+	}
+	uint64_t end_ns = GetClockTime(CLOCK_MONOTONIC_RAW);
+
+	_result->cost_ns_ = _count > 0 ? (double)(end_ns - start_ns) / _count : 0;
+	_result->resolution_ns_ = resolution == UINT64_MAX ? 0 : resolution * ns_per_tick;
+}
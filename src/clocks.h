@@ -1,15 +1,45 @@
 #pragma once
 
 #include <stdint.h>
+#include <time.h>
+#include <sched.h>
+
+// every elapse counter is in ticks of the selected clock, converted to ns on dump
+enum ClockSource {
+	kClockSourceTsc,
+	kClockSourceMonotonicRaw,
+	kClockSourceThreadCpu,
+	kClockSourceCount,
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CLOCK_HAS_TSC 1
+#if defined(USE_RDTSCP)
+#define CLOCK_HAS_RDTSCP 1
+#endif
+#endif
+
+static inline uint64_t GetClockTime(const clockid_t _clock_id) {
+	struct timespec ti;
+	clock_gettime(_clock_id, &ti);
+	return (uint64_t)ti.tv_sec * 1000000000L + ti.tv_nsec;
+}
 
-#ifdef USE_RDTSCP
-static inline uint64_t GetTime(void) {
-	uint32_t eax, edx, aux;
-	__asm__ __volatile__("rdtscp" : "=a"(eax), "=d"(edx), "=c"(aux));
+#ifdef CLOCK_HAS_RDTSCP
+// TSC_AUX holds (node << 12) | cpu on linux
+static inline uint64_t GetTscTimeCpu(uint32_t *_cpu) {
+	uint32_t eax, edx;
+	__asm__ __volatile__("rdtscp" : "=a"(eax), "=d"(edx), "=c"(*_cpu));
 	return ((uint64_t)edx) << 32 | eax;
 }
-#elif USE_RDTSC
-static inline uint64_t GetTime(void) {
+#endif
+
+// without a tsc this is the raw monotonic clock, ClockTscHz then says 1 GHz
+static inline uint64_t GetTscTime(void) {
+#if defined(CLOCK_HAS_RDTSCP)
+	uint32_t aux;
+	return GetTscTimeCpu(&aux);
+#elif defined(CLOCK_HAS_TSC)
 	uint32_t eax, edx;
 	/*
 	 * the lfence is to wait (on Intel:CPUS) until all previous
@@ -17,12 +47,58 @@ static inline uint64_t GetTime(void) {
 	 */
 	__asm__ __volatile__("lfence;rdtsc" : "=a"(eax), "=d"(edx));
 	return ((uint64_t)edx) << 32 | eax;
+#else
+	return GetClockTime(CLOCK_MONOTONIC_RAW);
+#endif
 }
+
+static inline uint64_t GetSourceTime(const ClockSource _source) {
+	switch (_source) {
+	case kClockSourceTsc:
+		return GetTscTime();
+	case kClockSourceThreadCpu:
+		return GetClockTime(CLOCK_THREAD_CPUTIME_ID);
+	default:
+		return GetClockTime(CLOCK_MONOTONIC_RAW);
+	}
+}
+
+// also tells which cpu the time was read on, 0 for the thread cpu clock
+// which neither migration nor preemption can distort
+static inline uint64_t GetTimeCpu(const ClockSource _source, uint32_t *_cpu) {
+	switch (_source) {
+	case kClockSourceTsc:
+#ifdef CLOCK_HAS_RDTSCP
+		return GetTscTimeCpu(_cpu);
 #else
-#include <time.h>
-static inline uint64_t GetTime(void) {
+		*_cpu = (uint32_t)sched_getcpu();
+		return GetTscTime();
+#endif
+	case kClockSourceThreadCpu:
+		*_cpu = 0;
+		return GetClockTime(CLOCK_THREAD_CPUTIME_ID);
+	default:
+		*_cpu = (uint32_t)sched_getcpu();
+		return GetClockTime(CLOCK_MONOTONIC_RAW);
+	}
+}
+
+// milliseconds since the epoch, for stamping snapshots
+static inline uint64_t GetWallTimeMs(void) {
 	struct timespec ti;
 	clock_gettime(CLOCK_REALTIME, &ti);
-	return (uint64_t)ti.tv_sec * 1000000000L + ti.tv_nsec;
+	return (uint64_t)ti.tv_sec * 1000 + ti.tv_nsec / 1000000;
 }
-#endif
\ No newline at end of file
+
+struct ClockBenchResult {
+	double cost_ns_;		// per read
+	double resolution_ns_;	// smallest step seen between two reads
+};
+
+bool ClockTscInvariant(void);
+uint64_t ClockTscHz(void);
+ClockSource ClockDefaultSource(void);
+const char *ClockSourceName(ClockSource _source);
+bool ClockSourceByName(const char *_name, ClockSource *_source);
+double ClockNsPerTick(ClockSource _source);
+void ClockBench(ClockSource _source, int _count, ClockBenchResult *_result);
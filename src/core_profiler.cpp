@@ -1,241 +1,356 @@
 #include <stdio.h>
 #include <assert.h>
+#include <limits.h>
 #include <string.h>
+#include <dlfcn.h>
+#include <string>
 #include <unordered_map>
-#include <map>
 #include <set>
 #include <algorithm>
 #include <vector>
 
 #include "core_profiler.h"
 #include "stack.h"
+#include "record_tree.h"
 #include "clocks.h"
+#include "sampler.h"
+#include "hash_map.h"
 
 using namespace std;
 
 static int kProfilerStateId;
+static int kProfilerGuardId;
 static const char *kLuaApiFilterList[] = {"next", "require", "assert", "error", "getmetatable", "setmetatable", 
 										"ipairs", "pairs", "xpcall", "pcall", "rawequal", "rawget", "rawset", 
 										"rawlen", "select", "tonumber", "tostring", "type", "for iterator", NULL};
-static const size_t kMutiStackBufferInitCount = 10240;
-
-struct FunctionInfo {
-	string name_;
-	string source_;
-	int linedefined_;
-
-	FunctionInfo(const char *_name, const char *_source, int _line)
-		: name_(_name ? _name : "?")
-		, linedefined_(_line) {
-		if (_source) {
-			if (_source[0] == '@' || _source[0] == '=') {
-				source_ = _source;
-			} else {
-				source_ = "(string)";
-			}
-		}
-	}
+static const int kSampleDefaultHz = 100;
+static const int kSampleMaxHz = 10000;
+static const int kRecordDefaultKeep = 256;
+static const int kRecordDefaultStride = 16;
+static const int kRecordDefaultCapacity = 1024;
+static const int kRecordDefaultKeyframe = 32;
+static const int kRecordMaxCapacity = 1 << 20;
+static const size_t kCallInfoStackPoolSize = 256;
+static const int kCalibrateCalls = 100000;
+static const int kCalibrateRounds = 3;
+static const char *kCalibrateChunk = "local f = function() end for i = 1, %d do f() end";
+static const int kGcPauseBuckets = 24;	// bucket i counts pauses under 2^i us
+static const int kAllocAgeBuckets = 16;	// bucket i counts blocks that survived under 2^i cycles
+static const int kAllocSampleMaxKb = 1 << 20;
+static const int kLineDumpDefaultTop = 10;	// hottest lines listed per function
+static const size_t kLineDumpMaxText = 80;
+
+// every state gets its own mark for the FunctionInfo it leaves on a Proto
+static unsigned int g_proto_mark = 0;
+
+enum ProfilerMode {
+	kProfilerModeHook,
+	kProfilerModeVm,
+	kProfilerModeSample,
 };
 
-#pragma pack(1)
-typedef struct RecordData {
-	uint32_t call_count_;
-	uint64_t inner_elapse_;
+struct ProfilerOptions {
+	ProfilerMode mode_;
+	ClockSource clock_;
+	int hz_;
+	int preempt_us_;
+	bool calibrate_;
+	bool alloc_;
+	bool gc_;
+	bool line_;
+	int alloc_sample_kb_;	// 0 keeps no lifetime tags
+	int record_keep_;
+	int record_stride_;
+	int record_capacity_;
+	int record_keyframe_;
+
+	ProfilerOptions(void)
+		: mode_(kProfilerModeHook)
+		, clock_(ClockDefaultSource())
+		, hz_(kSampleDefaultHz)
+		, preempt_us_(0)
+		, calibrate_(true)
+		, alloc_(false)
+		, gc_(true)
+		, line_(false)
+		, alloc_sample_kb_(0)
+		, record_keep_(kRecordDefaultKeep)
+		, record_stride_(kRecordDefaultStride)
+		, record_capacity_(kRecordDefaultCapacity)
+		, record_keyframe_(kRecordDefaultKeyframe) {}
+};
 
-	RecordData(void) : call_count_(0), inner_elapse_(0) {}
-} RecordData;
-#pragma pack()
+#pragma pack(1)
+typedef struct CallInfo {
+	Record *record_;
+	uint64_t enter_time_;
+	uint32_t enter_cpu_;
+	int depth_;		// position of the frame in the thread's ci list
+	int line_;		// running line relative to linedefined, -1 outside line mode
+
+	CallInfo(int _depth, Record *_record)
+		: record_(_record)
+		, enter_time_(0)
+		, enter_cpu_(0)
+		, depth_(_depth)
+		, line_(-1) { }
+
+	// intervals longer than _preempt ticks are taken as preempted
+	inline void AddElapse(uint64_t _time, uint32_t _cpu, uint64_t _preempt) {
+		uint64_t elapse = _time - enter_time_;
+		record_->AddInnerElapse(elapse);
+		if (line_ >= 0) {
+			record_->func_info_->AddLineElapse(line_, elapse);
+		}
 
-typedef MultiStackBuffer<RecordData> RecordBuffer;
-typedef StaticBuffer<RecordData> RecordCopy;
+		if (_cpu != enter_cpu_) {
+			record_->AddContaminated(elapse, kRecordMigrateCount);
+		} else if (elapse > _preempt) {
+			record_->AddContaminated(elapse, kRecordPreemptCount);
+		}
+	}
 
-struct Record {
-	RecordBuffer &buffer_;
-	FunctionInfo *func_info_;
-	uint64_t temp_inner_elapse_;
-	uint64_t temp_full_elapse_;
-	uint32_t temp_call_count_;
-	size_t index_;
-	RecordData *data_;
+	inline Record *ChildCallEnter(RecordTree &_tree, uint64_t _time, uint32_t _cpu, uint64_t _preempt, FunctionInfo *_info) {
+		AddElapse(_time, _cpu, _preempt);
+		enter_time_ = 0;
+		return _tree.GetChildRecord(record_, _info);
+	}
 
-	typedef map<FunctionInfo *, Record *> ChildrenFunctionMap;
-	ChildrenFunctionMap children_;
+	inline void ChildCallBack(uint64_t _time, uint32_t _cpu) {
+		enter_time_ = _time;
+		enter_cpu_ = _cpu;
+	}
 
-	typedef vector<Record *> ChildrenList;
-	ChildrenList children_list_;
+	inline void OnEnter(uint64_t _time, uint32_t _cpu) {
+		enter_time_ = _time;
+		enter_cpu_ = _cpu;
+		record_->AddCount();
+	}
 
-	struct RecordSort {
-		bool operator() (const Record *t1, const Record *t2) {
-			return t1->temp_full_elapse_ > t2->temp_full_elapse_;
+	// self time splits at line changes, so the lines of a function add up
+	// to its self time
+	inline void OnLine(uint64_t _time, uint32_t _cpu, uint64_t _preempt, int _line) {
+		if (enter_time_ != 0) {
+			AddElapse(_time, _cpu, _preempt);
 		}
-	};
-
-	Record(RecordBuffer &_buffer, FunctionInfo *_info) 
-		: buffer_(_buffer) 
-		, func_info_(_info)
-		, temp_inner_elapse_(0)
-		, temp_full_elapse_(0)
-		, temp_call_count_(0) {
-		const RecordBuffer::ElementPair& element = buffer_.Get();
-		index_ = element.first;
-		data_ = element.second;
+		enter_time_ = _time;
+		enter_cpu_ = _cpu;
+		line_ = _line;
+		record_->func_info_->AddLineHit(_line);
 	}
 
-	~Record(void) {
-		ChildrenList::const_iterator ibegin = children_list_.begin();
-		ChildrenList::const_iterator iend = children_list_.end();
-		for (; ibegin != iend; ++ibegin) {
-			Record *record = *ibegin;
-			delete record;
+	inline void OnExit(uint64_t _time, uint32_t _cpu, uint64_t _preempt) {
+		if (enter_time_ != 0) {
+			AddElapse(_time, _cpu, _preempt);
+			enter_time_ = 0;
 		}
-
-		children_list_.clear();
-		children_.clear();
 	}
 
-	inline void AddCount(void) {
-		data_->call_count_++;
+	inline void CoroutineJump(uint64_t _time, uint32_t _cpu, uint64_t _preempt) {
+		AddElapse(_time, _cpu, _preempt);
+		enter_time_ = 0;
 	}
+} CallInfo;
+#pragma pack()
 
-	inline void AddInnerElapse(uint64_t elapse) {
-		data_->inner_elapse_ += elapse;
-	}
+// a sampled block stands for weight_ allocated bytes
+struct AllocTag {
+	RecordId record_;
+	uint32_t epoch_;	// collector cycles finished before it was allocated
+	size_t weight_;
+};
 
-	inline Record *GetChildRecord(FunctionInfo *_info) {
-		ChildrenFunctionMap::const_iterator citr = children_.find(_info);
-		if (citr != children_.end()) {
-			return citr->second;
-		}
+struct AllocSite {
+	RecordId record_;
+	uint64_t count_;
+	uint64_t bytes_;
+	uint64_t age_bytes_[kAllocAgeBuckets];
 
-		Record *new_record = new Record(buffer_, _info);
-		children_list_.push_back(new_record);
-		children_.insert(make_pair(_info, new_record));
-		return new_record;
+	bool operator<(const AllocSite &_other) const {
+		return bytes_ > _other.bytes_;
 	}
+};
 
-	uint64_t CalcChildrenElapse(void) {
-		uint64_t total_children_elapse = 0;
-		if (!children_list_.empty()) {
-			ChildrenList::const_iterator ibegin = children_list_.begin();
-			ChildrenList::const_iterator iend = children_list_.end();
-			for (; ibegin != iend; ++ibegin) {
-				Record *record = *ibegin;
-				total_children_elapse += record->CalcChildrenElapse();
-			}
+// line mode totals of one function, for ordering the report
+struct FunctionLines {
+	FunctionInfo *info_;
+	uint64_t count_;
+	uint64_t elapse_;
 
-			if (children_list_.size() > 1) {
-				sort(children_list_.begin(), children_list_.end(), RecordSort());
-			}
-		}
+	bool operator<(const FunctionLines &_other) const {
+		return elapse_ > _other.elapse_;
+	}
+};
 
-		temp_inner_elapse_ = data_->inner_elapse_;
-		temp_call_count_ = data_->call_count_;
-		temp_full_elapse_ = temp_inner_elapse_ + total_children_elapse;
+typedef vector<string> SourceLines;
+typedef unordered_map<string, SourceLines> SourceLinesMap;
 
-		return temp_full_elapse_;
+// text of a '@file' source, read once per report. empty when unreadable
+static const SourceLines &LoadSourceLines(SourceLinesMap &_cache, const string &_source) {
+	SourceLinesMap::iterator itr = _cache.find(_source);
+	if (itr != _cache.end()) {
+		return itr->second;
 	}
 
-	uint64_t CalcChildrenElapse(const RecordCopy *_start_record, const RecordCopy *_end_record) {
-		uint64_t total_children_elapse = 0;
-		if (!children_list_.empty()) {
-			ChildrenList::const_iterator ibegin = children_list_.begin();
-			ChildrenList::const_iterator iend = children_list_.end();
-			for (; ibegin != iend; ++ibegin) {
-				Record *record = *ibegin;
-				total_children_elapse += record->CalcChildrenElapse(_start_record, _end_record);
-			}
+	SourceLines &lines = _cache[_source];
+	FILE *fp = _source.size() > 1 && _source[0] == '@' ? fopen(_source.c_str() + 1, "r") : NULL;
+	if (!fp) {
+		return lines;
+	}
 
-			if (children_list_.size() > 1) {
-				sort(children_list_.begin(), children_list_.end(), RecordSort());
-			}
+	string line;
+	int c;
+	while ((c = fgetc(fp)) != EOF) {
+		if (c == '\n') {
+			lines.push_back(line);
+			line.clear();
+		} else {
+			line.push_back((char)c);
 		}
+	}
+	lines.push_back(line);
+	fclose(fp);
+	return lines;
+}
 
-		temp_inner_elapse_ = 0;
-		temp_call_count_ = 0;
-
-		const RecordData *start = NULL;
-		if (_start_record) {
-			start = _start_record->At(index_);
+typedef PtrHashMap<AllocTag> AllocTagMap;
+typedef vector<AllocSite> AllocSiteList;
+
+// folds the live tags into one entry per call tree record
+struct AllocSiteCollector {
+	unordered_map<RecordId, size_t> index_;
+	AllocSiteList *sites_;
+	uint32_t epoch_;
+
+	AllocSiteCollector(AllocSiteList *_sites, uint32_t _epoch) : sites_(_sites), epoch_(_epoch) {}
+
+	void operator()(const void *_block, const AllocTag &_tag) {
+		unordered_map<RecordId, size_t>::const_iterator citr = index_.find(_tag.record_);
+		size_t pos = citr != index_.end() ? citr->second : sites_->size();
+		if (pos == sites_->size()) {
+			AllocSite site;
+			memset(&site, 0, sizeof(site));
+			site.record_ = _tag.record_;
+			sites_->push_back(site);
+			index_[_tag.record_] = pos;
 		}
 
-		const RecordData *end = _end_record->At(index_);
-		if (end) {
-			if (start) {
-				temp_inner_elapse_ = end->inner_elapse_ - start->inner_elapse_;
-				temp_call_count_ = end->call_count_ - start->call_count_;
-			} else {
-				temp_inner_elapse_ = end->inner_elapse_;
-				temp_call_count_ = end->call_count_;
-			}
+		uint32_t age = epoch_ - _tag.epoch_;
+		int bucket = 0;
+		while (age > 0 && bucket < kAllocAgeBuckets - 1) {
+			age >>= 1;
+			bucket++;
 		}
 
-		temp_full_elapse_ = temp_inner_elapse_ + total_children_elapse;
-
-		return temp_full_elapse_;
+		AllocSite &site = (*sites_)[pos];
+		site.count_++;
+		site.bytes_ += _tag.weight_;
+		site.age_bytes_[bucket] += _tag.weight_;
 	}
 };
 
-#pragma pack(1)
-typedef struct CallInfo {
-	const void *func_;
-	Record *record_;
-	uint64_t enter_time_;
-
-	CallInfo(const void *_f, Record *_record)
-		: func_(_f)
-		, record_(_record)
-		, enter_time_(0) { }
-
-	inline Record *ChildCallEnter(uint64_t _time, FunctionInfo *_info) {
-		record_->AddInnerElapse(_time - enter_time_);
-		enter_time_ = 0;
-		return record_->GetChildRecord(_info);
+// lua 5.3 passes the object type as osize when a new object is allocated
+static inline RecordColumn AllocColumn(size_t _tag) {
+	switch (_tag) {
+	case LUA_TTABLE:
+		return kRecordAllocTable;
+	case LUA_TSTRING:
+		return kRecordAllocString;
+	case LUA_TFUNCTION:
+		return kRecordAllocFunction;
+	case LUA_TUSERDATA:
+		return kRecordAllocUserdata;
+	default:
+		return kRecordAllocOther;
 	}
+}
 
-	inline void ChildCallBack(uint64_t _time) {
-		enter_time_ = _time;
+// the optional record columns the options fill
+static inline uint32_t RecordColumns(const ProfilerOptions &_options) {
+	uint32_t columns = 0;
+	if (_options.alloc_) {
+		columns |= kRecordAllocColumns;
 	}
+	return columns;
+}
 
-	inline void OnEnter(uint64_t _time) {
-		enter_time_ = _time;
-		record_->AddCount();
-	}
+class LuaProfilerState;
 
-	inline void OnExit(uint64_t _time) {
-		if (enter_time_ != 0) {
-			record_->AddInnerElapse(_time - enter_time_);
-			enter_time_ = 0;
-		}
-	}
+// ud of the installed allocator. when the host stacks its own allocator on
+// ours it may still call us after stop, so the trampoline then outlives the
+// state and only forwards
+struct AllocTrampoline {
+	lua_Alloc f_;		// the allocator we wrap
+	void *ud_;
+	LuaProfilerState *state_;	// NULL once detached
+};
 
-	inline void CoroutineJump(void) {
-		record_->AddInnerElapse(GetTime() - enter_time_);
-		enter_time_ = 0;
-	}
-} CallInfo;
-#pragma pack()
+// lives in the LUA_EXTRASPACE of every thread. lua_newthread copies the
+// main thread's area, so it is only trusted when owner_ is the thread itself
+struct ProfilerContext {
+	LuaProfilerState *state_;
+	StackBuffer<CallInfo> *stack_;
+	ShadowStack *shadow_;	// sample mode only
+	lua_State *owner_;
+};
+
+static_assert(sizeof(ProfilerContext) <= LUA_EXTRASPACE, "LUA_EXTRASPACE too small for ProfilerContext");
+
+static inline ProfilerContext *GetContext(lua_State *L) {
+	return (ProfilerContext *)lua_getextraspace(L);
+}
+
+// runs in the signal handler, only reads the thread's own context
+static ShadowStack *ProfilerShadowLookup(lua_State *L) {
+	ProfilerContext *context = GetContext(L);
+	return context->owner_ == L ? context->shadow_ : NULL;
+}
 
 class LuaProfilerState {
 	typedef set<string> LuaFilterApiNameMap;
-	typedef set<const void *> LuaFilterApiMap;
-	
-	typedef unordered_map<int, FunctionInfo *> FunctionInfoMap;
-	typedef unordered_map<const void *, FunctionInfoMap *> LuaProfilerfuncsMap;
-	typedef unordered_map<const void *, FunctionInfo *> CProfilerfuncsMap;
+
+	typedef PtrHashMap<FunctionInfo *> FunctionInfoCache;
+	typedef vector<FunctionInfo *> FunctionInfoList;
 
 	typedef StackBuffer<CallInfo> CallInfoStack;
 	typedef unordered_map<lua_State *, CallInfoStack *> CallInfoStackMap;
+	typedef vector<CallInfoStack *> CallInfoStackPool;
 
 public:
-	LuaProfilerState(void) 
-		: record_buffer_(kMutiStackBufferInitCount)
-		, root_profiler_record_(record_buffer_, NULL)
+	LuaProfilerState(const ProfilerOptions &_options) 
+		: options_(_options)
+		, ns_per_tick_(ClockNsPerTick(_options.clock_))
+		, preempt_ticks_(_options.preempt_us_ > 0 ? (uint64_t)(_options.preempt_us_ * 1000.0 / ns_per_tick_) : UINT64_MAX)
+		, proto_mark_(__sync_add_and_fetch(&g_proto_mark, 1))
+		, unnamed_func_infos_(0)
+		, record_tree_(_options.record_keep_, _options.record_stride_, _options.record_capacity_, _options.record_keyframe_,
+			RecordColumns(_options), ns_per_tick_)
 		, curr_lua_state_(NULL)
 		, curr_call_info_(NULL)
-		, curr_call_info_stack_(NULL) {}
+		, curr_call_info_stack_(NULL)
+		, paused_(false)
+		, calibrated_(false)
+		, overhead_parent_(0)
+		, overhead_child_(0)
+		, alloc_trampoline_(NULL)
+		, alloc_interval_((int64_t)_options.alloc_sample_kb_ * 1024)
+		, alloc_countdown_(alloc_interval_)
+		, gc_cycles_(0)
+		, gc_step_info_(NULL)
+		, gc_full_info_(NULL)
+		, gc_finalizer_info_(NULL)
+		, gc_record_(NULL)
+		, gc_phase_(-1)
+		, gc_phase_time_(0)
+		, gc_begin_time_(0)
+		, gc_depth_(0) {
+		memset(gc_pauses_, 0, sizeof(gc_pauses_));
+	}
 
 	~LuaProfilerState(void) {
-		lua_filter_api_.clear();
+		if (alloc_trampoline_) {
+			alloc_trampoline_->state_ = NULL;
+		}
 
 		for (CallInfoStackMap::const_iterator citr = call_info_stack_map_.begin();
 			citr != call_info_stack_map_.end(); ++citr) {
@@ -244,274 +359,855 @@ public:
 		}
 		call_info_stack_map_.clear();
 
-		for (LuaProfilerfuncsMap::const_iterator citr = lua_profiler_funcs_.begin();
-			citr != lua_profiler_funcs_.end(); ++citr) {
-			FunctionInfoMap *func_infos = citr->second;
-
-			for (FunctionInfoMap::const_iterator citr2 = func_infos->begin();
-				citr2 != func_infos->end(); ++citr2) {
-				FunctionInfo *info = citr2->second;
-				delete info;
-			}
-
-			func_infos->clear();
-			delete func_infos;
+		for (CallInfoStackPool::const_iterator citr = call_info_stack_pool_.begin();
+			citr != call_info_stack_pool_.end(); ++citr) {
+			delete *citr;
 		}
-		lua_profiler_funcs_.clear();
+		call_info_stack_pool_.clear();
 
-		for (CProfilerfuncsMap::const_iterator citr = c_profiler_funcs_.begin();
-			citr != c_profiler_funcs_.end(); ++citr) {
-			FunctionInfo *info = citr->second;
+		for (FunctionInfoList::const_iterator citr = func_info_list_.begin();
+			citr != func_info_list_.end(); ++citr) {
+			FunctionInfo *info = *citr;
 			delete info;
 		}
-		c_profiler_funcs_.clear();
+		func_info_list_.clear();
+		func_info_cache_.Clear();
 	}
 
-	CallInfoStack *GetCallInfoStack(lua_State *L) {
+	inline CallInfoStack *GetCallInfoStack(lua_State *L) {
+		ProfilerContext *context = GetContext(L);
+		if (context->owner_ == L && context->state_ == this) {
+			return context->stack_;
+		}
+
 		CallInfoStackMap::const_iterator citr = call_info_stack_map_.find(L);
 		if (citr != call_info_stack_map_.end()) {
+			BindContext(L, citr->second);
 			return citr->second;
 		}
 
 		return NULL;
 	}
 
-	void CreateCallInfoStack(lua_State *L) {
+	CallInfoStack *CreateCallInfoStack(lua_State *L) {
 		CallInfoStack *call_info_stack = GetCallInfoStack(L);
 		if (call_info_stack) {
 			call_info_stack->Clear();
+		} else if (!call_info_stack_pool_.empty()) {
+			call_info_stack = call_info_stack_pool_.back();
+			call_info_stack_pool_.pop_back();
+			call_info_stack_map_.insert(make_pair(L, call_info_stack));
 		} else {
-			CallInfoStack *new_call_info_stack = new CallInfoStack();
-			call_info_stack_map_.insert(make_pair(L, new_call_info_stack));
+			call_info_stack = new CallInfoStack();
+			call_info_stack_map_.insert(make_pair(L, call_info_stack));
 		}
+
+		BindContext(L, call_info_stack);
+		return call_info_stack;
 	}
 
-	void Init(lua_State *L) {
-		lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
-		lua_State *main_L = lua_tothread(L, -1);
-		lua_pop(L, 1);
-		CreateCallInfoStack(main_L);
+	// called while the thread is being collected
+	void FreeCallInfoStack(lua_State *L) {
+		if (curr_lua_state_ == L) {
+			curr_lua_state_ = NULL;
+			curr_call_info_ = NULL;
+			curr_call_info_stack_ = NULL;
+		}
+
+		CallInfoStackMap::iterator itr = call_info_stack_map_.find(L);
+		if (itr == call_info_stack_map_.end()) {
+			return;
+		}
+
+		CallInfoStack *call_info_stack = itr->second;
+		call_info_stack_map_.erase(itr);
+		if (call_info_stack_pool_.size() < kCallInfoStackPoolSize) {
+			call_info_stack->Clear();
+			call_info_stack_pool_.push_back(call_info_stack);
+		} else {
+			delete call_info_stack;
+		}
+
+		memset(GetContext(L), 0, sizeof(ProfilerContext));
+	}
+
+	void BindContext(lua_State *L, CallInfoStack *_stack) {
+		ProfilerContext *context = GetContext(L);
+		context->state_ = this;
+		context->stack_ = _stack;
+		context->shadow_ = NULL;
+		context->owner_ = L;
+	}
+
+	// reseeds a stack kept over a pause, calls went unseen meanwhile. the
+	// new stack is published last so the handler never sees it half seeded
+	ShadowStack *SeedShadowStack(lua_State *L) {
+		ProfilerContext *context = GetContext(L);
+		if (context->owner_ == L && context->state_ == this && context->shadow_) {
+			context->shadow_->Seed(L);
+			return context->shadow_;
+		}
+
+		ShadowStack *shadow = new ShadowStack;
+		shadow->Seed(L);
+		context->shadow_ = NULL;
+		context->owner_ = NULL;
+		std::atomic_signal_fence(std::memory_order_release);
+		context->state_ = this;
+		context->stack_ = NULL;
+		context->shadow_ = shadow;
+		std::atomic_signal_fence(std::memory_order_release);
+		context->owner_ = L;
+		return shadow;
+	}
+
+	// called while the thread is being collected or released at stop
+	void FreeShadowStack(lua_State *L) {
+		sampler_.Forget(L);
+
+		ProfilerContext *context = GetContext(L);
+		if (context->owner_ != L || context->state_ != this || !context->shadow_) {
+			return;
+		}
+
+		ShadowStack *shadow = context->shadow_;
+		context->shadow_ = NULL;
+		std::atomic_signal_fence(std::memory_order_release);
+		delete shadow;
+	}
+
+	inline void ShadowCall(lua_State *L, int _event, const void *_f, const void *_proto, int _depth) {
+		ProfilerContext *context = GetContext(L);
+		ShadowStack *shadow = context->owner_ == L && context->state_ == this ? context->shadow_ : NULL;
+		if (!shadow) {
+			shadow = SeedShadowStack(L);
+		}
+
+		if (_event == LUA_HOOKRET) {
+			shadow->Return(_depth);
+		} else {
+			shadow->Call(_depth, _f, _proto);
+		}
+	}
+
+	void Init(void) {
+		if (options_.mode_ == kProfilerModeSample) {
+			return;
+		}
 
 		const char **temp = kLuaApiFilterList;
 		while (*temp) {
 			lua_filter_api_name_.insert(*temp);
 			temp++;
 		}
+
+		gc_step_info_ = NewGcInfo("[gc step]");
+		gc_full_info_ = NewGcInfo("[gc full]");
+		gc_finalizer_info_ = NewGcInfo("[finalizer]");
 	}
 
-	FunctionInfo *GetFunctionInfo(lua_Debug *ar, const void *_f) {
-		if (ar->what[0] == 'C') {
-			CProfilerfuncsMap::const_iterator citr = c_profiler_funcs_.find(_f);
-			if (citr != c_profiler_funcs_.end()) {
-				return citr->second;
-			}
+	bool StartSampler(lua_State *L, lua_Hook _hook) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+		lua_State *main_L = lua_tothread(L, -1);
+		lua_pop(L, 1);
 
-			lua_getinfo(curr_lua_state_, "n", ar);
+		return sampler_.Start(main_L, options_.hz_, _hook, ProfilerShadowLookup);
+	}
 
-			FunctionInfo *new_func_info = new FunctionInfo(ar->name, ar->source, ar->linedefined);
-			c_profiler_funcs_.insert(make_pair(_f, new_func_info));
+	inline ProfilerMode Mode(void) {
+		return options_.mode_;
+	}
 
-			if (ar->name && lua_filter_api_name_.find(ar->name) != lua_filter_api_name_.end()) {
-				lua_filter_api_.insert(_f);
-				return NULL;
-			}
+	inline const ProfilerOptions &Options(void) {
+		return options_;
+	}
 
-			return new_func_info;
-		} else {
-			FunctionInfoMap *func_info_map = NULL;
-			LuaProfilerfuncsMap::const_iterator citr = lua_profiler_funcs_.find((const void *)ar->source);
-			if (citr != lua_profiler_funcs_.end()) {
-				func_info_map = citr->second;
-
-				FunctionInfoMap::const_iterator nitr = func_info_map->find(ar->linedefined);
-				if (nitr != func_info_map->end()) {
-					return nitr->second;
-				}
-			} else {
-				func_info_map = new FunctionInfoMap();
-				lua_profiler_funcs_.insert(make_pair((const void *)ar->source, func_info_map));
+	inline void SetOverhead(double _parent, double _child) {
+		calibrated_ = true;
+		overhead_parent_ = _parent;
+		overhead_child_ = _child;
+	}
+
+	// reads back the synthetic loop of ProfilerCalibrate: root -> chunk -> f,
+	// looked up by source and line so stray gc or alloc records do not matter
+	bool MeasureOverhead(int _calls, uint64_t _plain, double *_parent, double *_child) {
+		record_tree_.CalcRecord(NULL, NULL);
+		RecordId chunk = FindCalibrateRecord(kRootRecordId, 0);
+		if (chunk == kNullRecordId) {
+			return false;
+		}
+
+		RecordId f = FindCalibrateRecord(chunk, 1);
+		if (f == kNullRecordId || record_tree_.CallCount(f) != (uint64_t)_calls) {
+			return false;
+		}
+
+		double measured = (double)record_tree_.InnerElapse(chunk) + record_tree_.FullElapse(f);
+		*_child = (double)record_tree_.FullElapse(f) / _calls;
+		*_parent = max((measured - _plain) / _calls - *_child, 0.0);
+		return true;
+	}
+
+	inline RecordId FindCalibrateRecord(RecordId _parent, int _line) {
+		for (RecordId child = record_tree_.Link(_parent)->first_child_; child != kNullRecordId;
+			child = record_tree_.Link(child)->next_sibling_) {
+			const FunctionInfo *info = record_tree_.At(child)->func_info_;
+			if (info->linedefined_ == _line && info->source_ == "(string)") {
+				return child;
 			}
+		}
+		return kNullRecordId;
+	}
+
+	inline bool Paused(void) {
+		return paused_;
+	}
+
+	// closes the running frame and forgets every stack, the tree is kept
+	void Pause(void) {
+		sampler_.Stop();
+
+		if (curr_call_info_) {
+			uint32_t cpu = 0;
+			uint64_t time = GetTimeCpu(options_.clock_, &cpu);
+			curr_call_info_->OnExit(time, cpu, preempt_ticks_);
+		}
+
+		for (CallInfoStackMap::const_iterator citr = call_info_stack_map_.begin();
+			citr != call_info_stack_map_.end(); ++citr) {
+			citr->second->Clear();
+		}
+
+		curr_lua_state_ = NULL;
+		curr_call_info_ = NULL;
+		curr_call_info_stack_ = NULL;
+		gc_record_ = NULL;
+		gc_depth_ = 0;
+		paused_ = true;
+	}
+
+	inline void Resume(void) {
+		paused_ = false;
+	}
+
+	// zeroes every counter in place, the tree shape and sequence numbers stay
+	void Reset(lua_State *L) {
+		if (options_.mode_ == kProfilerModeSample) {
+			DrainSamples(L);
+		}
+
+		record_tree_.Reset();
+		memset(gc_pauses_, 0, sizeof(gc_pauses_));
+		for (FunctionInfoList::const_iterator citr = func_info_list_.begin(); citr != func_info_list_.end(); ++citr) {
+			(*citr)->ResetLines();
+		}
+
+		if (curr_call_info_ && curr_call_info_->enter_time_ != 0) {
+			uint32_t cpu = 0;
+			uint64_t time = GetTimeCpu(options_.clock_, &cpu);
+			curr_call_info_->ChildCallBack(time, cpu);
+		}
+	}
+
+	inline FunctionInfo *FindFunctionInfo(const FunctionId &_id) {
+		FunctionInfo **info = func_info_cache_.Find(_id.key_);
+		if (info && (*info)->source_id_ == _id.source_ && (*info)->linedefined_ == _id.linedefined_) {
+			return *info;
+		}
 
-			lua_getinfo(curr_lua_state_, "n", ar);
+		return NULL;
+	}
+
+	FunctionInfo *NewFunctionInfo(const FunctionId &_id, const char *_name, const char *_source) {
+		FunctionInfo *new_func_info = new FunctionInfo(_name, _source, _id.linedefined_);
+		new_func_info->source_id_ = _id.source_;
+
+		if (_id.linedefined_ < 0 && _name && lua_filter_api_name_.find(_name) != lua_filter_api_name_.end()) {
+			new_func_info->filtered_ = true;
+		}
+
+		func_info_list_.push_back(new_func_info);
+		func_info_cache_.Insert(_id.key_, new_func_info);
+		return new_func_info;
+	}
 
-			FunctionInfo *new_func_info = new FunctionInfo(ar->name, ar->source, ar->linedefined);
-			func_info_map->insert(make_pair(ar->linedefined, new_func_info));
+	// no function behind it, so kept out of the cache
+	FunctionInfo *NewGcInfo(const char *_name) {
+		FunctionInfo *new_func_info = new FunctionInfo(_name, "=[gc]", -1);
+		func_info_list_.push_back(new_func_info);
+		return new_func_info;
+	}
 
-			return new_func_info;
+	// frames deeper than _depth were unwound by an error or a longjmp and never
+	// get their return, the deepest one is charged up to now
+	inline void UnwindTo(int _depth, uint64_t _time, uint32_t _cpu) {
+		if (!curr_call_info_ || curr_call_info_->depth_ <= _depth) {
+			return;
 		}
+
+		curr_call_info_->OnExit(_time, _cpu, preempt_ticks_);
+		do {
+			curr_call_info_stack_->Pop();
+			if (curr_call_info_stack_->Empty()) {
+				curr_call_info_ = NULL;
+				return;
+			}
+
+			curr_call_info_ = curr_call_info_stack_->Top();
+		} while (curr_call_info_->depth_ > _depth);
+
+		curr_call_info_->ChildCallBack(_time, _cpu);
 	}
 
-	void CallHookIn(lua_Debug *ar, const void *_f) {
-		FunctionInfo *func_info = GetFunctionInfo(ar, _f);
-		if (!func_info) return;
+	void CallHookIn(FunctionInfo *func_info, int _depth, bool _tailcall) {
+		uint32_t curr_cpu = 0;
+		uint64_t curr_time = GetTimeCpu(options_.clock_, &curr_cpu);
+		// a tail call reuses the depth of the frame it replaces
+		UnwindTo(_tailcall ? _depth : _depth - 1, curr_time, curr_cpu);
+		PushFrame(func_info, _depth, _tailcall, curr_time, curr_cpu);
+	}
 
-		uint64_t curr_time = GetTime();
+	void PushFrame(FunctionInfo *func_info, int _depth, bool _tailcall, uint64_t curr_time, uint32_t curr_cpu) {
 		Record *record = NULL;
 		if (curr_call_info_) {
-			record = curr_call_info_->ChildCallEnter(curr_time, func_info);
+			record = curr_call_info_->ChildCallEnter(record_tree_, curr_time, curr_cpu, preempt_ticks_, func_info);
 
-			if (ar->event == LUA_HOOKTAILCALL) {
+			if (_tailcall && curr_call_info_->depth_ == _depth) {
 				curr_call_info_stack_->Pop();
 			}
 		} else {
-			record = root_profiler_record_.GetChildRecord(func_info);
+			record = record_tree_.GetChildRecord(record_tree_.Root(), func_info);
 		}
 
-		curr_call_info_ = curr_call_info_stack_->Get(_f, record);
-		curr_call_info_->OnEnter(curr_time);
+		curr_call_info_ = curr_call_info_stack_->Get(_depth, record);
+		curr_call_info_->OnEnter(curr_time, curr_cpu);
 	}
 
-	void CallHookOut(const void *_f) {
+	void CallHookOut(int _depth) {
 		if (!curr_call_info_) {
 			return;
 		}
 
-		if (curr_call_info_->func_ != _f) {
-			do {
-				curr_call_info_stack_->Pop();
-				if (curr_call_info_stack_->Empty()) {
-					curr_call_info_ = NULL;
-					return;
-				}
+		uint32_t curr_cpu = 0;
+		uint64_t curr_time = GetTimeCpu(options_.clock_, &curr_cpu);
+		PopFrame(_depth, curr_time, curr_cpu);
+	}
+
+	void PopFrame(int _depth, uint64_t curr_time, uint32_t curr_cpu) {
+		UnwindTo(_depth, curr_time, curr_cpu);
 
-				curr_call_info_ = curr_call_info_stack_->Top();
-			} while (curr_call_info_->func_ != _f);
+		// entered before the profiler started or through a filtered function
+		if (!curr_call_info_ || curr_call_info_->depth_ != _depth) {
+			return;
 		}
 
-		uint64_t curr_time = GetTime();
-		curr_call_info_->OnExit(curr_time);
+		curr_call_info_->OnExit(curr_time, curr_cpu, preempt_ticks_);
 		curr_call_info_stack_->Pop();
 
 		if (curr_call_info_stack_->Empty()) {
 			curr_call_info_ = NULL;
 		} else {
 			curr_call_info_ = curr_call_info_stack_->Top();
-			curr_call_info_->ChildCallBack(curr_time);
+			curr_call_info_->ChildCallBack(curr_time, curr_cpu);
+		}
+	}
+
+	void SwitchState(lua_State *L) {
+		if (curr_call_info_) {
+			uint32_t cpu = 0;
+			uint64_t time = GetTimeCpu(options_.clock_, &cpu);
+			curr_call_info_->CoroutineJump(time, cpu, preempt_ticks_);
+			curr_call_info_ = NULL;
+		}
+
+		curr_lua_state_ = L;
+		curr_call_info_stack_ = GetCallInfoStack(L);
+		if (!curr_call_info_stack_) {
+			curr_call_info_stack_ = CreateCallInfoStack(L);
+		} else if (!curr_call_info_stack_->Empty()) {
+			curr_call_info_ = curr_call_info_stack_->Top();
 		}
 	}
 
 	int Hook(lua_State *L, lua_Debug *ar) {
 		if (curr_lua_state_ != L) {
-			if (curr_call_info_) {
-				curr_call_info_->CoroutineJump();
-				curr_call_info_ = NULL;
-			}
-
-			curr_lua_state_ = L;
-			curr_call_info_stack_ = GetCallInfoStack(L);
-			if (!curr_call_info_stack_) {
-				// error long jump
-				return luaL_error(L, "profiler lua_State[%p] stack not find", L);
-			} else {
-				if (!curr_call_info_stack_->Empty()) {
-					curr_call_info_ = curr_call_info_stack_->Top();
-				}
-			}
+			SwitchState(L);
 		}
 
 		if (!curr_call_info_stack_) {
 			return 0;
 		}
 
-		if (ar->event == LUA_HOOKRET) {
-			lua_getinfo(L, "f", ar);
-		} else {
-			lua_getinfo(L, "Sf", ar);
+		if (ar->event == LUA_HOOKLINE) {
+			LineHook(L, ar->currentline);
+			return 0;
 		}
 
-		const void *f = lua_topointer(L, -1);
+		lua_getinfo(L, "f", ar);
+
+		FunctionId id;
+		LuaFunctionId(L, -1, &id);
 		lua_pop(L, 1);
 
-		if (lua_filter_api_.find(f) != lua_filter_api_.end()) {
+		FunctionInfo *func_info = FindFunctionInfo(id);
+		if (ar->event == LUA_HOOKRET) {
+			if (!func_info || !func_info->filtered_) {
+				CallHookOut(LuaHookDepth(ar));
+			}
+
 			return 0;
 		}
 
-		if (ar->event == LUA_HOOKRET) {
-			CallHookOut(f);
-		} else {
-			CallHookIn(ar, f);
+		if (!func_info) {
+			lua_getinfo(L, "Sn", ar);
+			func_info = NewFunctionInfo(id, ar->name, ar->source);
+		}
+
+		if (!func_info->filtered_) {
+			CallHookIn(func_info, LuaHookDepth(ar), ar->event == LUA_HOOKTAILCALL);
 		}
 
 		return 0;
 	}
 
-	void Save(void) {
-		record_buffer_.Save();
+	// currentline comes with the event, no lookup needed. frames we do not
+	// track, entered before start or filtered, keep their lines to themselves
+	inline void LineHook(lua_State *L, int _line) {
+		if (!curr_call_info_) {
+			return;
+		}
+
+		uint32_t curr_cpu = 0;
+		uint64_t curr_time = GetTimeCpu(options_.clock_, &curr_cpu);
+		int depth = LuaCallDepth(L);
+		UnwindTo(depth, curr_time, curr_cpu);
+		if (!curr_call_info_ || curr_call_info_->depth_ != depth) {
+			return;
+		}
+
+		int line = _line - max(curr_call_info_->record_->func_info_->linedefined_, 0);
+		if (line >= 0) {
+			curr_call_info_->OnLine(curr_time, curr_cpu, preempt_ticks_, line);
+		}
 	}
 
-	uint64_t CalcRecord(lua_State *L) {
-		uint64_t temp_full_elapse = 0;
-		int n = lua_gettop(L);
-		if (n == 1) {
-			temp_full_elapse = root_profiler_record_.CalcChildrenElapse();
-		} else if (n == 3) {
-			int start_index = (int)luaL_checknumber(L, 2);
-			if (start_index >= (int)record_buffer_.GetRecordCount()) {
-				// error long jump
-				return luaL_error(L, "profiler dump start index error");
-			}
+	void VmHook(lua_State *L, int _event, const void *_f, const void *_proto, int _depth) {
+		if (curr_lua_state_ != L) {
+			SwitchState(L);
+		}
 
-			int end_index = (int)luaL_checknumber(L, 3);
-			if (end_index < 0 || end_index >= (int)record_buffer_.GetRecordCount()) {
-				// error long jump
-				return luaL_error(L, "profiler dump end index error");
+		// a lua function is looked up once per run, then read off its Proto
+		FunctionInfo *func_info = _proto ? (FunctionInfo *)LuaProtoData(_proto, proto_mark_) : NULL;
+		FunctionId id;
+		if (!func_info) {
+			if (_proto) {
+				LuaProtoId(_proto, &id);
+			} else {
+				CFunctionId(_f, &id);
 			}
 
-			if (start_index >= end_index) {
-				// error long jump
-				return luaL_error(L, "profiler dump start_index >= end_index error");
+			func_info = FindFunctionInfo(id);
+			if (func_info && _proto) {
+				LuaSetProtoData(_proto, proto_mark_, func_info);
 			}
+		}
 
-			const RecordCopy *start_record = NULL;
-			if (start_index >= 0) {
-				start_record = record_buffer_.GetRecordByIndex(start_index);
+		if (_event == LUA_HOOKRET) {
+			if (!func_info || !func_info->filtered_) {
+				CallHookOut(_depth);
 			}
 
-			const RecordCopy *end_record = record_buffer_.GetRecordByIndex(end_index);
-			if (!end_record) {
-				return luaL_error(L, "profiler dump end index error");
-			}
+			return;
+		}
 
-			temp_full_elapse = root_profiler_record_.CalcChildrenElapse(start_record, end_record);
-		} else {
-			// error long jump
-			return luaL_error(L, "profiler args error");
+		if (!func_info) {
+			// the frame being entered is level 0
+			lua_Debug ar;
+			lua_getstack(L, 0, &ar);
+			lua_getinfo(L, "Sn", &ar);
+			func_info = NewFunctionInfo(id, ar.name, ar.source);
+			if (_proto) {
+				LuaSetProtoData(_proto, proto_mark_, func_info);
+			}
 		}
 
-		return temp_full_elapse;
+		if (!func_info->filtered_) {
+			CallHookIn(func_info, _depth, _event == LUA_HOOKTAILCALL);
+		}
 	}
 
-	void Data2Json(FILE *fp, double total_elapse, Record *_record) {
-		double full_per = _record->temp_full_elapse_ / total_elapse * 100;
-		double self_per = _record->temp_inner_elapse_ / total_elapse * 100;
-
-		const FunctionInfo *func_info = _record->func_info_;
-		if (func_info) {
-			fprintf(fp, "'call':'%s:%s:%d','count':%u,'total':%ld,'totalPercent':%.3lf,'self':%ld,'selfPercent':%.3lf",
-				func_info->name_.c_str(), func_info->source_.c_str(), func_info->linedefined_, _record->temp_call_count_, _record->temp_full_elapse_, full_per, _record->temp_inner_elapse_, self_per);
-		} else {
-			fprintf(fp, "'call':'root','count':1,'total':%ld,'totalPercent':100,'self':0,'selfPercent':0", _record->temp_full_elapse_);
+	// collector work becomes a synthetic child of the frame it interrupts and
+	// takes its depth, so finalizers called from it nest below
+	void GcCall(lua_State *L, int _event, int _phase) {
+		// the atomic phase runs once per cycle, it dates the sampled blocks
+		if (_event == LUA_GCPHASE && _phase == LUA_GCPHASEATOMIC) {
+			gc_cycles_++;
 		}
 
-		if (!_record->children_list_.empty()) {
-			fprintf(fp, ",'subcall':[");
-			Record::ChildrenList::const_iterator ibegin = _record->children_list_.begin();
-			Record::ChildrenList::const_iterator iend = _record->children_list_.end();
-			for (; ibegin != iend; ++ibegin) {
-				fprintf(fp, "{");
-				Data2Json(fp, total_elapse, *ibegin);
-				fprintf(fp, "},");
-			}
-			fprintf(fp, "]");
+		if (!options_.gc_) {
+			return;
+		}
+
+		if (curr_lua_state_ != L) {
+			SwitchState(L);
+		}
+
+		uint32_t curr_cpu = 0;
+		uint64_t curr_time = GetTimeCpu(options_.clock_, &curr_cpu);
+		int depth = LuaCallDepth(L);
+		switch (_event) {
+		case LUA_GCPHASE:
+			ChargeGcPhase(curr_time);
+			gc_phase_ = _phase;
+			break;
+		case LUA_GCSTEPBEGIN:
+		case LUA_GCFULLBEGIN:
+			UnwindTo(depth, curr_time, curr_cpu);
+			PushFrame(_event == LUA_GCSTEPBEGIN ? gc_step_info_ : gc_full_info_, depth, false, curr_time, curr_cpu);
+			if (gc_depth_++ == 0) {
+				gc_record_ = curr_call_info_->record_;
+				gc_phase_ = -1;
+				gc_begin_time_ = curr_time;
+			}
+			break;
+		case LUA_GCSTEPEND:
+		case LUA_GCFULLEND:
+			if (gc_depth_ > 0 && --gc_depth_ == 0) {
+				ChargeGcPhase(curr_time);
+				AddGcPause(curr_time - gc_begin_time_);
+				gc_record_ = NULL;
+			}
+			PopFrame(depth, curr_time, curr_cpu);
+			break;
+		case LUA_GCTMBEGIN:
+			UnwindTo(depth, curr_time, curr_cpu);
+			PushFrame(gc_finalizer_info_, depth, false, curr_time, curr_cpu);
+			break;
+		case LUA_GCTMEND:
+			PopFrame(depth, curr_time, curr_cpu);
+			break;
+		}
+	}
+
+	// the phase time of nested collections goes to the outermost one
+	inline void ChargeGcPhase(uint64_t _time) {
+		if (gc_record_ && gc_phase_ >= 0) {
+			record_tree_.AddGcElapse(gc_record_, _time - gc_phase_time_, gc_phase_);
+		}
+		gc_phase_time_ = _time;
+	}
+
+	inline void AddGcPause(uint64_t _elapse) {
+		uint64_t us = (uint64_t)(_elapse * ns_per_tick_) / 1000;
+		int bucket = 0;
+		while (us > 0 && bucket < kGcPauseBuckets - 1) {
+			us >>= 1;
+			bucket++;
+		}
+		gc_pauses_[bucket]++;
+	}
+
+	// counts every pause since start or reset, whatever window is dumped
+	void GcPauses2Json(FILE *fp) {
+		bool first = true;
+		for (int i = 0; i < kGcPauseBuckets; ++i) {
+			if (gc_pauses_[i] == 0) {
+				continue;
+			}
+
+			fprintf(fp, "%s'%lu':%lu", first ? ",'gcPauseUs':{" : ",", (uint64_t)1 << i, gc_pauses_[i]);
+			first = false;
+		}
+
+		if (!first) {
+			fprintf(fp, "}");
+		}
+	}
+
+	static void CallName2Json(FILE *fp, const FunctionInfo *_info) {
+		if (_info) {
+			fprintf(fp, "'%s:%s:%d'", _info->name_.c_str(), _info->source_.c_str(), _info->linedefined_);
+		} else {
+			fprintf(fp, "'root'");
+		}
+	}
+
+	// blocks still live among the sampled ones, per allocating record with
+	// its callers leaf first, heaviest site first
+	void AllocSites2Json(FILE *fp) {
+		if (alloc_interval_ == 0) {
+			return;
+		}
+
+		AllocSiteList sites;
+		alloc_tags_.Foreach(AllocSiteCollector(&sites, gc_cycles_));
+		sort(sites.begin(), sites.end());
+
+		fprintf(fp, ",'allocSampleBytes':%ld,'gcCycles':%u,'allocSites':[", alloc_interval_, gc_cycles_);
+		for (AllocSiteList::const_iterator citr = sites.begin(); citr != sites.end(); ++citr) {
+			fprintf(fp, "{'call':");
+			CallName2Json(fp, record_tree_.At(citr->record_)->func_info_);
+			fprintf(fp, ",'liveCount':%lu,'liveBytes':%lu,'stack':[", citr->count_, citr->bytes_);
+			for (RecordId id = record_tree_.Parent(citr->record_); id != kNullRecordId && id != kRootRecordId;
+				id = record_tree_.Parent(id)) {
+				CallName2Json(fp, record_tree_.At(id)->func_info_);
+				fprintf(fp, ",");
+			}
+
+			fprintf(fp, "],'ageBytes':{");
+			for (int i = 0; i < kAllocAgeBuckets; ++i) {
+				if (citr->age_bytes_[i] != 0) {
+					fprintf(fp, "'%lu':%lu,", (uint64_t)1 << i, citr->age_bytes_[i]);
+				}
+			}
+			fprintf(fp, "}},");
+		}
+		fprintf(fp, "]");
+	}
+
+	FunctionInfo *GetSampleFunctionInfo(const StackFrame &_frame) {
+		FunctionId id;
+		if (_frame.proto_) {
+			LuaProtoId(_frame.proto_, &id);
+		} else {
+			CFunctionId(_frame.func_, &id);
+		}
+
+		FunctionInfo *func_info = FindFunctionInfo(id);
+		if (func_info) {
+			return func_info;
+		}
+
+		if (_frame.proto_) {
+			const char *source = NULL;
+			int linedefined = 0;
+			LuaProtoInfo(_frame.proto_, &source, &linedefined);
+			unnamed_func_infos_++;
+			return NewFunctionInfo(id, NULL, source);
+		}
+
+		// no call site to take the name from, use the symbol instead
+		Dl_info dl_info;
+		const char *name = NULL;
+		if (dladdr(_frame.func_, &dl_info) && dl_info.dli_sname) {
+			name = dl_info.dli_sname;
+		}
+
+		return NewFunctionInfo(id, name, "=[C]");
+	}
+
+	void NameSampleFunctions(lua_State *L) {
+		lua_Debug ar;
+		for (int level = 0; unnamed_func_infos_ > 0 && lua_getstack(L, level, &ar); ++level) {
+			lua_getinfo(L, "nf", &ar);
+			const void *proto = LuaFunctionProto(L, -1);
+			lua_pop(L, 1);
+
+			if (!proto || !ar.name) continue;
+
+			FunctionId id;
+			LuaProtoId(proto, &id);
+			FunctionInfo *func_info = FindFunctionInfo(id);
+			if (func_info && func_info->name_ == "?") {
+				func_info->name_ = ar.name;
+				unnamed_func_infos_--;
+			}
+		}
+	}
+
+	void DrainSamples(lua_State *L) {
+		// the armed thread may have yielded or died before its hook ran
+		sampler_.Disarm();
+
+		Sample *sample = NULL;
+		while ((sample = sampler_.Front()) != NULL) {
+			Record *root = record_tree_.Root();
+			Record *record = root;
+			for (int i = sample->depth_ - 1; i >= 0; --i) {
+				record = record_tree_.GetChildRecord(record, GetSampleFunctionInfo(sample->frames_[i]));
+				record->AddCount();
+			}
+
+			if (record != root) {
+				record->AddInnerElapse((uint64_t)(sample->weight_ / ns_per_tick_));
+			}
+
+			sampler_.Pop();
+		}
+
+		if (unnamed_func_infos_ > 0) {
+			NameSampleFunctions(L);
+		}
+	}
+
+	// blocks are charged to the record running on the current thread
+	inline void *Alloc(void *_ptr, size_t _osize, size_t _nsize) {
+		void *block = alloc_trampoline_->f_(alloc_trampoline_->ud_, _ptr, _osize, _nsize);
+		if (!block && _nsize != 0) {
+			return NULL;
+		}
+
+		Record *record = curr_call_info_ ? curr_call_info_->record_ : record_tree_.Root();
+		if (!_ptr) {
+			if (_nsize != 0) {
+				record_tree_.AddAlloc(record, _nsize, AllocColumn(_osize));
+			}
+		} else if (_nsize > _osize) {
+			record_tree_.AddAlloc(record, _nsize - _osize, kRecordAllocOther);
+		} else {
+			record_tree_.AddFree(record, _osize - _nsize);
+		}
+
+		if (alloc_interval_ != 0) {
+			TagAlloc(record, _ptr, block, _ptr ? _osize : 0, _nsize);
+		}
+
+		return block;
+	}
+
+	// every alloc_interval_ bytes handed out tag the block that crossed the
+	// mark, a tag follows its block through reallocs until the free
+	inline void TagAlloc(Record *_record, void *_ptr, void *_block, size_t _osize, size_t _nsize) {
+		AllocTag *tag = _ptr && alloc_tags_.Size() != 0 ? alloc_tags_.Find(_ptr) : NULL;
+		if (tag) {
+			AllocTag moved = *tag;
+			if (_block != _ptr || _nsize == 0) {
+				alloc_tags_.Erase(_ptr);
+				if (_nsize != 0) {
+					alloc_tags_.Insert(_block, moved);
+				}
+			}
+			return;
+		}
+
+		if (_nsize <= _osize) {
+			return;
+		}
+
+		alloc_countdown_ -= (int64_t)(_nsize - _osize);
+		if (alloc_countdown_ > 0) {
+			return;
+		}
+
+		int64_t crossed = -alloc_countdown_ / alloc_interval_ + 1;
+		alloc_countdown_ += crossed * alloc_interval_;
+
+		AllocTag new_tag;
+		new_tag.record_ = _record->id_;
+		new_tag.epoch_ = gc_cycles_;
+		new_tag.weight_ = (size_t)(crossed * alloc_interval_);
+		alloc_tags_.Insert(_block, new_tag);
+	}
+
+	// frees went by unseen while unwrapped, old tags could name reused blocks
+	void WrapAlloc(lua_State *L, lua_Alloc _f) {
+		alloc_tags_.Clear();
+		alloc_countdown_ = alloc_interval_;
+		alloc_trampoline_ = new AllocTrampoline;
+		alloc_trampoline_->f_ = lua_getallocf(L, &alloc_trampoline_->ud_);
+		alloc_trampoline_->state_ = this;
+		lua_setallocf(L, _f, alloc_trampoline_);
+	}
+
+	// when the host has stacked an allocator on ours since, the trampoline
+	// is left behind as a pass-through and deliberately leaked, the host
+	// still holds it
+	void UnwrapAlloc(lua_State *L) {
+		if (!alloc_trampoline_) {
+			return;
+		}
+
+		void *ud = NULL;
+		lua_getallocf(L, &ud);
+		if (ud == alloc_trampoline_) {
+			lua_setallocf(L, alloc_trampoline_->f_, alloc_trampoline_->ud_);
+			delete alloc_trampoline_;
+		} else {
+			alloc_trampoline_->state_ = NULL;
+		}
+		alloc_trampoline_ = NULL;
+	}
+
+	void SampleHook(lua_State *L) {
+		DrainSamples(L);
+	}
+
+	uint64_t Save(lua_State *L, const char *_label) {
+		if (options_.mode_ == kProfilerModeSample) {
+			DrainSamples(L);
+		}
+
+		return record_tree_.Save(GetWallTimeMs(), _label);
+	}
+
+	void RecordList(lua_State *L) {
+		const RecordTree::RecordRing &snapshots = record_tree_.Snapshots();
+		lua_createtable(L, (int)snapshots.Size(), 0);
+		for (size_t i = 0; i < snapshots.Size(); ++i) {
+			const RecordTree::RecordEntry &entry = snapshots.At(i);
+			lua_createtable(L, 0, 3);
+			lua_pushinteger(L, (lua_Integer)entry.seq_);
+			lua_setfield(L, -2, "seq");
+			lua_pushinteger(L, (lua_Integer)entry.time_);
+			lua_setfield(L, -2, "time");
+			lua_pushlstring(L, entry.label_.data(), entry.label_.size());
+			lua_setfield(L, -2, "label");
+			lua_rawseti(L, -2, (lua_Integer)i + 1);
 		}
 	}
 
+	uint64_t CalcRecord(lua_State *L) {
+		uint64_t temp_full_elapse = 0;
+		int n = lua_gettop(L);
+		if (n == 1) {
+			temp_full_elapse = record_tree_.CalcRecord(NULL, NULL);
+		} else if (n == 3) {
+			// indices are record_save sequence numbers, -1 starts from zero
+			lua_Integer start_index = luaL_checkinteger(L, 2);
+			lua_Integer end_index = luaL_checkinteger(L, 3);
+			if (start_index >= end_index) {
+				// error long jump
+				return luaL_error(L, "profiler dump start_index >= end_index error");
+			}
+
+			const RecordCopy *start_record = NULL;
+			if (start_index >= 0) {
+				start_record = record_tree_.StartSnapshot((uint64_t)start_index);
+				if (!start_record) {
+					// error long jump
+					return luaL_error(L, "profiler dump start index[%d] not retained", (int)start_index);
+				}
+			}
+
+			const RecordCopy *end_record = end_index >= 0 ? record_tree_.EndSnapshot((uint64_t)end_index) : NULL;
+			if (!end_record) {
+				// error long jump
+				return luaL_error(L, "profiler dump end index[%d] not retained", (int)end_index);
+			}
+
+			temp_full_elapse = record_tree_.CalcRecord(start_record, end_record);
+		} else {
+			// error long jump
+			return luaL_error(L, "profiler args error");
+		}
+
+		return temp_full_elapse;
+	}
+
 	int Dump2json(lua_State *L) {
+		if (options_.mode_ == kProfilerModeSample) {
+			DrainSamples(L);
+		}
+
 		uint64_t temp_full_elapse = CalcRecord(L);
 		if (temp_full_elapse == 0) {
 			return luaL_error(L, "profiler CalcRecord error");
 		}
 
+		if (calibrated_) {
+			record_tree_.Compensate(overhead_parent_, overhead_child_);
+		}
+
 		const char *file_name = luaL_checkstring(L, 1);
 		if (!file_name) {
 			return luaL_error(L, "profiler file_name == NULL error");
@@ -523,7 +1219,13 @@ public:
 		}
 
 		fprintf(fp, "{");
-		Data2Json(fp, temp_full_elapse, &root_profiler_record_);
+		record_tree_.Data2Json(fp, temp_full_elapse, kRootRecordId);
+		if (options_.mode_ == kProfilerModeSample) {
+			// lost to a full ring since start, whatever the window
+			fprintf(fp, ",'samplesDropped':%lu", sampler_.DroppedCount());
+		}
+		GcPauses2Json(fp);
+		AllocSites2Json(fp);
 		fprintf(fp, "}");
 		fflush(fp);
 		fclose(fp);
@@ -531,29 +1233,449 @@ public:
 		return 0;
 	}
 
+	// annotated source of the hottest lines per function, self time since
+	// start or reset
+	int LineDump(lua_State *L) {
+		if (!options_.line_) {
+			return luaL_error(L, "profiler line mode off");
+		}
+
+		const char *file_name = luaL_checkstring(L, 1);
+		int top = (int)luaL_optinteger(L, 2, kLineDumpDefaultTop);
+		if (top <= 0) {
+			return luaL_error(L, "profiler line_dump top[%d] error", top);
+		}
+
+		// no lua error may long jump past the vectors below
+		FILE *fp = fopen(file_name, "w+");
+		if (!fp) {
+			return luaL_error(L, "profiler file_name[%s] open error", file_name);
+		}
+
+		vector<FunctionLines> funcs;
+		uint64_t total = 0;
+		for (FunctionInfoList::const_iterator citr = func_info_list_.begin(); citr != func_info_list_.end(); ++citr) {
+			FunctionInfo *info = *citr;
+			FunctionLines func = {info, 0, 0};
+			for (size_t i = 0; i < info->line_count_.size(); ++i) {
+				func.count_ += info->line_count_[i];
+				func.elapse_ += info->line_elapse_[i];
+			}
+
+			if (func.count_ != 0) {
+				funcs.push_back(func);
+				total += func.elapse_;
+			}
+		}
+		sort(funcs.begin(), funcs.end());
+
+		double total_per = total > 0 ? 100.0 / total : 0;
+		SourceLinesMap sources;
+		vector<pair<uint64_t, int> > lines;
+		fprintf(fp, "# self time per line, total %.3f ms\n", total * ns_per_tick_ / 1e6);
+		fprintf(fp, "# %6s %10s %12s %8s\n", "line", "hits", "self_ms", "percent");
+		for (vector<FunctionLines>::const_iterator citr = funcs.begin(); citr != funcs.end(); ++citr) {
+			const FunctionInfo *info = citr->info_;
+			fprintf(fp, "\n%s %s:%d self %.3f ms %.2f%% hits %lu\n", info->name_.c_str(), info->source_.c_str(),
+				info->linedefined_, citr->elapse_ * ns_per_tick_ / 1e6, citr->elapse_ * total_per, citr->count_);
+
+			lines.clear();
+			for (size_t i = 0; i < info->line_count_.size(); ++i) {
+				if (info->line_count_[i] != 0) {
+					lines.push_back(make_pair(info->line_elapse_[i], (int)i));
+				}
+			}
+			sort(lines.rbegin(), lines.rend());
+			if (lines.size() > (size_t)top) {
+				lines.resize(top);
+			}
+
+			const SourceLines &text = LoadSourceLines(sources, info->source_);
+			int base = max(info->linedefined_, 0);
+			for (vector<pair<uint64_t, int> >::const_iterator litr = lines.begin(); litr != lines.end(); ++litr) {
+				int line = base + litr->second;
+				string code = line > 0 && (size_t)line <= text.size() ? text[line - 1] : string();
+				size_t first = code.find_first_not_of(" \t");
+				code = first != string::npos ? code.substr(first, kLineDumpMaxText) : string();
+
+				fprintf(fp, "  %6d %10lu %12.3f %7.2f%%  %s\n", line, info->line_count_[litr->second],
+					litr->first * ns_per_tick_ / 1e6, litr->first * total_per, code.c_str());
+			}
+		}
+		fflush(fp);
+		fclose(fp);
+
+		return 0;
+	}
+
 private:
-	LuaFilterApiNameMap lua_filter_api_name_;
-	LuaFilterApiMap lua_filter_api_;
+	ProfilerOptions options_;
+	double ns_per_tick_;
+	uint64_t preempt_ticks_;	// intervals longer than this are taken as preempted
 
-	LuaProfilerfuncsMap lua_profiler_funcs_;
-	CProfilerfuncsMap c_profiler_funcs_;
+	LuaFilterApiNameMap lua_filter_api_name_;
 
-	RecordBuffer record_buffer_;
+	FunctionInfoCache func_info_cache_;
+	FunctionInfoList func_info_list_;
+	unsigned int proto_mark_;	// a Proto carrying it points at our FunctionInfo
+	int unnamed_func_infos_;
 
-	Record root_profiler_record_;
+	RecordTree record_tree_;
 
 	CallInfoStackMap call_info_stack_map_;
+	CallInfoStackPool call_info_stack_pool_;
 	lua_State *curr_lua_state_;
 	CallInfo *curr_call_info_;
 	CallInfoStack *curr_call_info_stack_;
+	bool paused_;
+
+	bool calibrated_;
+	double overhead_parent_;	// ticks per child call, charged to the caller
+	double overhead_child_;		// ticks per call, charged to the callee
+	AllocTrampoline *alloc_trampoline_;	// NULL while unwrapped
+	int64_t alloc_interval_;	// bytes between two tagged blocks, 0 for none
+	int64_t alloc_countdown_;
+	AllocTagMap alloc_tags_;
+	uint32_t gc_cycles_;
+
+	FunctionInfo *gc_step_info_;
+	FunctionInfo *gc_full_info_;
+	FunctionInfo *gc_finalizer_info_;
+	Record *gc_record_;			// outermost step or full collection running
+	int gc_phase_;		// LUA_GCPHASE*, -1 before the first phase
+	uint64_t gc_phase_time_;
+	uint64_t gc_begin_time_;
+	int gc_depth_;
+	uint64_t gc_pauses_[kGcPauseBuckets];
+
+	Sampler sampler_;
 };
 
 static void Profilerhook(lua_State *L, lua_Debug *ar) {
+	ProfilerContext *context = GetContext(L);
+	LuaProfilerState *S = context->owner_ == L ? context->state_ : NULL;
+	if (!S) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, (int64_t)&kProfilerStateId);
+		S = (LuaProfilerState *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+	}
+
+	if (S) S->Hook(L, ar);
+}
+
+static void ProfilerVmcall(lua_State *L, int event, const void *func, const void *proto, int depth, void *ud) {
+	LuaProfilerState *S = (LuaProfilerState *)ud;
+	S->VmHook(L, event, func, proto, depth);
+}
+
+static void *ProfilerAlloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	AllocTrampoline *T = (AllocTrampoline *)ud;
+	if (!T->state_) {
+		return T->f_(T->ud_, ptr, osize, nsize);
+	}
+	return T->state_->Alloc(ptr, osize, nsize);
+}
+
+static void ProfilerGccall(lua_State *L, int event, int phase, void *ud) {
+	LuaProfilerState *S = (LuaProfilerState *)ud;
+	S->GcCall(L, event, phase);
+}
+
+static void ProfilerSamplecall(lua_State *L, int event, const void *func, const void *proto, int depth, void *ud) {
+	LuaProfilerState *S = (LuaProfilerState *)ud;
+	S->ShadowCall(L, event, func, proto, depth);
+}
+
+static void ProfilerThreadcall(lua_State *L, lua_State *L1, int event, void *ud) {
+	LuaProfilerState *S = (LuaProfilerState *)ud;
+	if (event == LUA_THREADFREE) {
+		S->FreeShadowStack(L1);
+		S->FreeCallInfoStack(L1);
+	}
+}
+
+static void SampleDrainhook(lua_State *L, lua_Debug *ar) {
 	lua_rawgeti(L, LUA_REGISTRYINDEX, (int64_t)&kProfilerStateId);
 	LuaProfilerState *S = (LuaProfilerState *)lua_touserdata(L, -1);
 	lua_pop(L, 1);
 
-	if (S) S->Hook(L, ar);
+	if (S) S->SampleHook(L);
+}
+
+// threads created before start neither inherit the hook nor have a stack yet
+static void ProfilerAttachThread(lua_State *L1, void *ud) {
+	LuaProfilerState *S = (LuaProfilerState *)ud;
+	// vm mode takes calls from profcall, only lines come through the hook
+	int mask = S->Mode() == kProfilerModeHook ? LUA_MASKCALL | LUA_MASKRET : 0;
+	if (S->Options().line_) {
+		mask |= LUA_MASKLINE;
+	}
+	if (mask != 0) {
+		lua_sethook(L1, (lua_Hook)Profilerhook, mask, 0);
+	}
+
+	S->CreateCallInfoStack(L1);
+}
+
+static void ProfilerUnhookThread(lua_State *L1) {
+	lua_Hook hook = lua_gethook(L1);
+	if (hook == (lua_Hook)Profilerhook || hook == (lua_Hook)SampleDrainhook) {
+		lua_sethook(L1, NULL, 0, 0);
+	}
+}
+
+static void ProfilerDetachThread(lua_State *L1, void *ud) {
+	ProfilerUnhookThread(L1);
+}
+
+static void ProfilerSeedThread(lua_State *L1, void *ud) {
+	LuaProfilerState *S = (LuaProfilerState *)ud;
+	S->SeedShadowStack(L1);
+}
+
+// nothing may point at the state once it is freed
+static void ProfilerReleaseThread(lua_State *L1, void *ud) {
+	ProfilerUnhookThread(L1);
+
+	ProfilerContext *context = GetContext(L1);
+	if (context->state_ == ud) {
+		((LuaProfilerState *)ud)->FreeShadowStack(L1);
+		memset(context, 0, sizeof(ProfilerContext));
+	}
+}
+
+static void ProfilerDetach(lua_State *L, LuaProfilerState *S, bool _release);
+
+// unhooks every thread and frees the state, nothing reaches it afterwards
+static void ProfilerRelease(lua_State *L, LuaProfilerState *S) {
+	S->Pause();
+	ProfilerDetach(L, S, true);
+
+	lua_pushnil(L);
+	lua_rawseti(L, LUA_REGISTRYINDEX, (int64_t)&kProfilerStateId);
+
+	delete S;
+}
+
+// at lua_close finalizers still to come may call into hooked functions
+static int ProfilerGc(lua_State *L) {
+	LuaProfilerState **guard = (LuaProfilerState **)lua_touserdata(L, 1);
+	LuaProfilerState *S = *guard;
+	if (S) {
+		*guard = NULL;
+		ProfilerRelease(L, S);
+	}
+
+	return 0;
+}
+
+static bool ProfilerAttach(lua_State *L, LuaProfilerState *S) {
+	// samples read the frames profcall keeps, seeded from the live stacks
+	if (S->Mode() == kProfilerModeSample) {
+		LuaForeachThread(L, ProfilerSeedThread, S);
+		lua_setprofcall(L, ProfilerSamplecall, S);
+		lua_setthreadcall(L, ProfilerThreadcall, S);
+		if (!S->StartSampler(L, (lua_Hook)SampleDrainhook)) {
+			ProfilerDetach(L, S, true);
+			return false;
+		}
+
+		return true;
+	}
+
+	LuaForeachThread(L, ProfilerAttachThread, S);
+	if (S->Mode() == kProfilerModeVm) {
+		lua_setprofcall(L, ProfilerVmcall, S);
+	}
+	lua_setthreadcall(L, ProfilerThreadcall, S);
+
+	if (S->Options().gc_ || S->Options().alloc_sample_kb_ > 0) {
+		lua_setgccall(L, ProfilerGccall, S);
+	}
+	if (S->Options().alloc_) {
+		S->WrapAlloc(L, ProfilerAlloc);
+	}
+
+	return true;
+}
+
+// thread callbacks stay while paused so dead coroutines still give their stacks back
+static void ProfilerDetach(lua_State *L, LuaProfilerState *S, bool _release) {
+	LuaForeachThread(L, _release ? ProfilerReleaseThread : ProfilerDetachThread, S);
+	if (S->Mode() != kProfilerModeHook) {
+		lua_setprofcall(L, NULL, NULL);
+	}
+	lua_setgccall(L, NULL, NULL);
+	S->UnwrapAlloc(L);
+
+	if (_release) {
+		lua_setthreadcall(L, NULL, NULL);
+	}
+}
+
+// times a synthetic call loop on a scratch lua_State, plain and then
+// through the same hooks as the real run, the difference is our own cost
+static void ProfilerCalibrate(LuaProfilerState *S) {
+	lua_State *L = luaL_newstate();
+	if (!L) {
+		return;
+	}
+
+	const char *chunk = lua_pushfstring(L, kCalibrateChunk, kCalibrateCalls);
+	if (luaL_loadstring(L, chunk) != LUA_OK) {
+		lua_close(L);
+		return;
+	}
+
+	uint64_t plain = UINT64_MAX;
+	for (int i = 0; i < kCalibrateRounds; ++i) {
+		lua_pushvalue(L, -1);
+		uint64_t start_time = GetSourceTime(S->Options().clock_);
+		lua_pcall(L, 0, 0, 0);
+		plain = min(plain, GetSourceTime(S->Options().clock_) - start_time);
+	}
+
+	// only mode and clock shape the call path, the rest would add records and cost of their own
+	ProfilerOptions options;
+	options.mode_ = S->Options().mode_;
+	options.clock_ = S->Options().clock_;
+	options.calibrate_ = false;
+	options.gc_ = false;
+
+	LuaProfilerState *C = new LuaProfilerState(options);
+	C->Init();
+	if (ProfilerAttach(L, C)) {
+		lua_pushvalue(L, -1);
+		lua_pcall(L, 0, 0, 0);
+		ProfilerDetach(L, C, true);
+
+		double parent = 0;
+		double child = 0;
+		if (C->MeasureOverhead(kCalibrateCalls, plain, &parent, &child)) {
+			S->SetOverhead(parent, child);
+		}
+	}
+
+	delete C;
+	lua_close(L);
+}
+
+static LuaProfilerState *GetProfilerState(lua_State *L) {
+	lua_rawgeti(L, LUA_REGISTRYINDEX, (int64_t)&kProfilerStateId);
+	LuaProfilerState *S = (LuaProfilerState *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	if (!S) {
+		// error long jump
+		luaL_error(L, "profiler not running");
+	}
+
+	return S;
+}
+
+static int ParseIntOption(lua_State *L, const char *_name, int _min, int _max, int *_value) {
+	lua_getfield(L, 1, _name);
+	if (!lua_isnil(L, -1)) {
+		if (!lua_isinteger(L, -1)) {
+			// error long jump
+			return luaL_error(L, "profiler %s must be an integer", _name);
+		}
+
+		lua_Integer value = lua_tointeger(L, -1);
+		if (value < _min || value > _max) {
+			// error long jump
+			return luaL_error(L, "profiler %s[%I] out of range", _name, value);
+		}
+		*_value = (int)value;
+	}
+	lua_pop(L, 1);
+
+	return 0;
+}
+
+static int ParseOptions(lua_State *L, ProfilerOptions *_options) {
+	if (lua_isnoneornil(L, 1)) {
+		return 0;
+	}
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	lua_getfield(L, 1, "mode");
+	if (!lua_isnil(L, -1)) {
+		const char *mode = lua_tostring(L, -1);
+		if (mode && strcmp(mode, "hook") == 0) {
+			_options->mode_ = kProfilerModeHook;
+		} else if (mode && strcmp(mode, "vm") == 0) {
+			_options->mode_ = kProfilerModeVm;
+		} else if (mode && strcmp(mode, "sample") == 0) {
+			_options->mode_ = kProfilerModeSample;
+		} else {
+			// error long jump
+			return luaL_error(L, "profiler unknown mode[%s]", mode ? mode : "?");
+		}
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 1, "clock");
+	if (!lua_isnil(L, -1)) {
+		const char *clock = lua_tostring(L, -1);
+		if (!clock || !ClockSourceByName(clock, &_options->clock_)) {
+			// error long jump
+			return luaL_error(L, "profiler unknown clock[%s]", clock ? clock : "?");
+		}
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 1, "calibrate");
+	if (!lua_isnil(L, -1)) {
+		_options->calibrate_ = lua_toboolean(L, -1) != 0;
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 1, "gc");
+	if (!lua_isnil(L, -1)) {
+		_options->gc_ = lua_toboolean(L, -1) != 0;
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 1, "alloc");
+	if (!lua_isnil(L, -1)) {
+		_options->alloc_ = lua_toboolean(L, -1) != 0;
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 1, "line");
+	if (!lua_isnil(L, -1)) {
+		_options->line_ = lua_toboolean(L, -1) != 0;
+	}
+	lua_pop(L, 1);
+
+	// line events come from the hook, samples only see functions
+	if (_options->line_ && _options->mode_ == kProfilerModeSample) {
+		// error long jump
+		return luaL_error(L, "profiler line needs hook or vm mode");
+	}
+
+	// lifetime tags live in the allocator wrapper
+	ParseIntOption(L, "alloc_sample_kb", 0, kAllocSampleMaxKb, &_options->alloc_sample_kb_);
+	if (_options->alloc_sample_kb_ > 0) {
+		_options->alloc_ = true;
+	}
+
+	// samples carry no current record to charge blocks to
+	if (_options->alloc_ && _options->mode_ == kProfilerModeSample) {
+		// error long jump
+		return luaL_error(L, "profiler alloc needs hook or vm mode");
+	}
+
+	ParseIntOption(L, "hz", 1, kSampleMaxHz, &_options->hz_);
+	ParseIntOption(L, "preempt_us", 0, INT_MAX, &_options->preempt_us_);
+	ParseIntOption(L, "record_keep", 1, kRecordMaxCapacity, &_options->record_keep_);
+	ParseIntOption(L, "record_stride", 0, kRecordMaxCapacity, &_options->record_stride_);
+	ParseIntOption(L, "record_capacity", 1, kRecordMaxCapacity, &_options->record_capacity_);
+	ParseIntOption(L, "record_keyframe", 1, kRecordMaxCapacity, &_options->record_keyframe_);
+
+	return 0;
 }
 
 int ProfilerStart(lua_State *L) {
@@ -564,12 +1686,80 @@ int ProfilerStart(lua_State *L) {
 	}
 	lua_pop(L, 1);
 
-	LuaProfilerState *S = new LuaProfilerState();
-	S->Init(L);
+	ProfilerOptions options;
+	ParseOptions(L, &options);
+
+	LuaProfilerState *S = new LuaProfilerState(options);
+	S->Init();
+	if (options.calibrate_ && options.mode_ != kProfilerModeSample) {
+		ProfilerCalibrate(S);
+	}
+	if (!ProfilerAttach(L, S)) {
+		delete S;
+		return luaL_error(L, "profiler init error");
+	}
+
 	lua_pushlightuserdata(L, S);
 	lua_rawseti(L, LUA_REGISTRYINDEX, (int64_t)&kProfilerStateId);
 
-	lua_sethook(L, (lua_Hook)Profilerhook, LUA_MASKCALL | LUA_MASKRET, 0);
+	// the timer and callbacks must not outlive the lua_State
+	LuaProfilerState **guard = (LuaProfilerState **)lua_newuserdata(L, sizeof(LuaProfilerState *));
+	*guard = S;
+	lua_newtable(L);
+	lua_pushcfunction(L, ProfilerGc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_rawseti(L, LUA_REGISTRYINDEX, (int64_t)&kProfilerGuardId);
+
+	return 0;
+}
+
+int ProfilerStop(lua_State *L) {
+	LuaProfilerState *S = GetProfilerState(L);
+
+	// an old guard collected later must not touch a newer state
+	lua_rawgeti(L, LUA_REGISTRYINDEX, (int64_t)&kProfilerGuardId);
+	LuaProfilerState **guard = (LuaProfilerState **)lua_touserdata(L, -1);
+	if (guard) *guard = NULL;
+	lua_pop(L, 1);
+
+	lua_pushnil(L);
+	lua_rawseti(L, LUA_REGISTRYINDEX, (int64_t)&kProfilerGuardId);
+
+	ProfilerRelease(L, S);
+
+	return 0;
+}
+
+int ProfilerPause(lua_State *L) {
+	LuaProfilerState *S = GetProfilerState(L);
+	if (S->Paused()) {
+		return 0;
+	}
+
+	S->Pause();
+	ProfilerDetach(L, S, false);
+
+	return 0;
+}
+
+int ProfilerResume(lua_State *L) {
+	LuaProfilerState *S = GetProfilerState(L);
+	if (!S->Paused()) {
+		return 0;
+	}
+
+	S->Resume();
+	if (!ProfilerAttach(L, S)) {
+		return luaL_error(L, "profiler resume error");
+	}
+
+	return 0;
+}
+
+int ProfilerReset(lua_State *L) {
+	LuaProfilerState *S = GetProfilerState(L);
+	S->Reset(L);
 
 	return 0;
 }
@@ -605,6 +1795,10 @@ int CoroutineCreate(lua_State *L) {
 		return luaL_error(L, "profiler CoroutineCreate co == NULL");
 	}
 
+	if (S->Mode() == kProfilerModeSample) {
+		return 0;
+	}
+
 	S->CreateCallInfoStack(co);
 
 	return 0;
@@ -619,7 +1813,65 @@ int RecordSave(lua_State *L) {
 		return luaL_error(L, "profiler not running");
 	}
 
-	S->Save();
+	const char *label = luaL_optstring(L, 1, NULL);
+	lua_pushinteger(L, (lua_Integer)S->Save(L, label));
 
-	return 0;
+	return 1;
+}
+
+int RecordList(lua_State *L) {
+	lua_rawgeti(L, LUA_REGISTRYINDEX, (int64_t)&kProfilerStateId);
+	LuaProfilerState *S = (LuaProfilerState *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	if (!S) {
+		return luaL_error(L, "profiler not running");
+	}
+
+	S->RecordList(L);
+
+	return 1;
+}
+
+int ClockBench(lua_State *L) {
+	int count = (int)luaL_optinteger(L, 1, 1000000);
+	if (count <= 0) {
+		return luaL_error(L, "profiler clock_bench count[%d] error", count);
+	}
+
+	lua_createtable(L, 0, kClockSourceCount + 4);
+	for (int i = 0; i < kClockSourceCount; ++i) {
+		ClockBenchResult result;
+		ClockBench((ClockSource)i, count, &result);
+
+		lua_createtable(L, 0, 2);
+		lua_pushnumber(L, result.cost_ns_);
+		lua_setfield(L, -2, "cost");
+		lua_pushnumber(L, result.resolution_ns_);
+		lua_setfield(L, -2, "resolution");
+		lua_setfield(L, -2, ClockSourceName((ClockSource)i));
+	}
+
+	lua_pushboolean(L, ClockTscInvariant());
+	lua_setfield(L, -2, "tsc_invariant");
+	lua_pushinteger(L, (lua_Integer)ClockTscHz());
+	lua_setfield(L, -2, "tsc_hz");
+	lua_pushstring(L, ClockSourceName(ClockDefaultSource()));
+	lua_setfield(L, -2, "default");
+
+	// the clock of the running profiler, none when stopped
+	lua_rawgeti(L, LUA_REGISTRYINDEX, (int64_t)&kProfilerStateId);
+	LuaProfilerState *S = (LuaProfilerState *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (S) {
+		lua_pushstring(L, ClockSourceName(S->Options().clock_));
+		lua_setfield(L, -2, "current");
+	}
+
+	return 1;
+}
+
+int LineDump(lua_State *L) {
+	LuaProfilerState *S = GetProfilerState(L);
+	return S->LineDump(L);
 }
@@ -3,6 +3,13 @@
 #include "lua.hpp"
 
 int ProfilerStart(lua_State *L);
+int ProfilerStop(lua_State *L);
+int ProfilerPause(lua_State *L);
+int ProfilerResume(lua_State *L);
+int ProfilerReset(lua_State *L);
 int ProfilerDump(lua_State *L);
 int CoroutineCreate(lua_State *L);
-int RecordSave(lua_State *L);
\ No newline at end of file
+int RecordSave(lua_State *L);
+int RecordList(lua_State *L);
+int ClockBench(lua_State *L);
+int LineDump(lua_State *L);
\ No newline at end of file
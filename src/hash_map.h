@@ -0,0 +1,157 @@
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+// open addressing map keyed by non-NULL pointers, linear probing
+template <typename T>
+class PtrHashMap {
+	static const size_t kInitCapacity = 64;
+
+	struct Entry {
+		const void *key_;
+		T value_;
+	};
+
+public:
+	PtrHashMap(const size_t _init_capacity = kInitCapacity)
+		: size_(0) {
+		size_t capacity = 8;
+		while (capacity < _init_capacity) {
+			capacity *= 2;
+		}
+		Rehash(capacity);
+	}
+
+	inline T *Find(const void *_key) {
+		assert(_key);
+		size_t pos = Hash(_key);
+		for (;;) {
+			Entry &entry = entries_[pos];
+			if (entry.key_ == _key) {
+				return &entry.value_;
+			}
+
+			if (!entry.key_) {
+				return NULL;
+			}
+
+			pos = (pos + 1) & mask_;
+		}
+	}
+
+	T *Insert(const void *_key, const T &_value) {
+		T *value = Find(_key);
+		if (value) {
+			*value = _value;
+			return value;
+		}
+
+		if ((size_ + 1) * 2 > entries_.size()) {
+			Rehash(entries_.size() * 2);
+		}
+
+		size_++;
+		return Place(_key, _value);
+	}
+
+	// backward shift deletion, probe chains stay intact without tombstones
+	bool Erase(const void *_key) {
+		assert(_key);
+		size_t pos = Hash(_key);
+		while (entries_[pos].key_ != _key) {
+			if (!entries_[pos].key_) {
+				return false;
+			}
+			pos = (pos + 1) & mask_;
+		}
+
+		size_t hole = pos;
+		for (;;) {
+			pos = (pos + 1) & mask_;
+			if (!entries_[pos].key_) {
+				break;
+			}
+
+			// an entry may fill the hole unless its home lies in (hole, pos]
+			size_t home = Hash(entries_[pos].key_);
+			if (((pos - home) & mask_) >= ((pos - hole) & mask_)) {
+				entries_[hole] = entries_[pos];
+				hole = pos;
+			}
+		}
+
+		entries_[hole].key_ = NULL;
+		size_--;
+		return true;
+	}
+
+	inline size_t Size(void) const {
+		return size_;
+	}
+
+	template <typename TFunc>
+	void Foreach(TFunc _func) {
+		for (size_t i = 0; i < entries_.size(); ++i) {
+			if (entries_[i].key_) {
+				_func(entries_[i].key_, entries_[i].value_);
+			}
+		}
+	}
+
+	void Clear(void) {
+		for (size_t i = 0; i < entries_.size(); ++i) {
+			entries_[i].key_ = NULL;
+		}
+		size_ = 0;
+	}
+
+private:
+	inline size_t Hash(const void *_key) const {
+		// fibonacci hashing, the low bits of pointers are mostly zero
+		return (size_t)(((uint64_t)(uintptr_t)_key * 0x9E3779B97F4A7C15ULL) >> shift_);
+	}
+
+	T *Place(const void *_key, const T &_value) {
+		size_t pos = Hash(_key);
+		while (entries_[pos].key_) {
+			pos = (pos + 1) & mask_;
+		}
+
+		entries_[pos].key_ = _key;
+		entries_[pos].value_ = _value;
+		return &entries_[pos].value_;
+	}
+
+	void Rehash(size_t _capacity) {
+		vector<Entry> old_entries;
+		old_entries.swap(entries_);
+
+		entries_.resize(_capacity);
+		for (size_t i = 0; i < _capacity; ++i) {
+			entries_[i].key_ = NULL;
+		}
+
+		mask_ = _capacity - 1;
+		shift_ = 64;
+		while (_capacity > 1) {
+			_capacity >>= 1;
+			shift_--;
+		}
+
+		for (size_t i = 0; i < old_entries.size(); ++i) {
+			if (old_entries[i].key_) {
+				Place(old_entries[i].key_, old_entries[i].value_);
+			}
+		}
+	}
+
+private:
+	size_t size_;
+	size_t mask_;
+	int shift_;
+	vector<Entry> entries_;
+};
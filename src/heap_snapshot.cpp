@@ -0,0 +1,648 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "heap_snapshot.h"
+#include "lua_internal.h"
+#include "hash_map.h"
+#include "stack.h"
+
+using namespace std;
+
+// binary snapshot, every number a varint:
+//   "LPHS" version time objects bytes heap_bytes
+//   type_count { name_len name count shallow }
+//   path_count { parent+1 label_len label type count shallow retained }
+// paths come in creation order, a parent is always written before its children
+static const char kHeapMagic[] = "LPHS";
+static const uint64_t kHeapVersion = 1;
+
+static const int kMaxPathDepth = 24;		// deeper objects are charged to their ancestor's path
+static const int kMaxPathChildren = 64;		// more distinct keys under one path fold into "[]"
+static const size_t kMaxLabelLen = 64;
+static const uint32_t kNoPath = (uint32_t)-1;
+
+struct HeapPath {
+	uint32_t parent_;
+	string label_;
+	int type_;
+	int depth_;
+	int child_count_;
+	uint64_t count_;
+	uint64_t shallow_;
+	uint64_t retained_;
+};
+
+struct HeapType {
+	string name_;
+	uint64_t count_;
+	uint64_t shallow_;
+};
+
+struct HeapPathKey {
+	uint32_t parent_;
+	int type_;
+	string label_;
+
+	bool operator<(const HeapPathKey &_other) const {
+		if (parent_ != _other.parent_) {
+			return parent_ < _other.parent_;
+		}
+		if (type_ != _other.type_) {
+			return type_ < _other.type_;
+		}
+		return label_ < _other.label_;
+	}
+};
+
+// the object graph with node 0 as a synthetic root above the real roots,
+// successors stored as one flat array indexed by edge_begin_
+struct HeapGraph {
+	lua_State *L_;
+	vector<const void *> objects_;
+	vector<uint32_t> shallow_;
+	vector<uint32_t> path_;
+	vector<int> type_;
+	vector<uint32_t> edge_begin_;
+	vector<uint32_t> edges_;
+	PtrHashMap<uint32_t> index_;
+	vector<HeapPath> paths_;
+	vector<HeapType> types_;
+	map<HeapPathKey, uint32_t> path_index_;
+	uint32_t current_;
+
+	HeapGraph(lua_State *L) : L_(L), index_(4096), current_(0) {}
+
+	int TypeIndex(const char *_name) {
+		for (size_t i = 0; i < types_.size(); ++i) {
+			if (types_[i].name_ == _name) {
+				return (int)i;
+			}
+		}
+
+		HeapType type;
+		type.name_ = _name;
+		type.count_ = 0;
+		type.shallow_ = 0;
+		types_.push_back(type);
+		return (int)types_.size() - 1;
+	}
+
+	uint32_t PathIndex(uint32_t _parent, const char *_label, size_t _label_len, int _type) {
+		if (_parent != kNoPath && paths_[_parent].depth_ >= kMaxPathDepth) {
+			return _parent;
+		}
+
+		HeapPathKey key;
+		key.parent_ = _parent;
+		key.type_ = _type;
+		key.label_.assign(_label, min(_label_len, kMaxLabelLen));
+
+		map<HeapPathKey, uint32_t>::const_iterator citr = path_index_.find(key);
+		if (citr != path_index_.end()) {
+			return citr->second;
+		}
+
+		if (_parent != kNoPath && paths_[_parent].child_count_ >= kMaxPathChildren && key.label_ != "[]") {
+			return PathIndex(_parent, "[]", 2, _type);
+		}
+
+		HeapPath path;
+		path.parent_ = _parent;
+		path.label_ = key.label_;
+		path.type_ = _type;
+		path.depth_ = _parent != kNoPath ? paths_[_parent].depth_ + 1 : 0;
+		path.child_count_ = 0;
+		path.count_ = 0;
+		path.shallow_ = 0;
+		path.retained_ = 0;
+		paths_.push_back(path);
+		if (_parent != kNoPath) {
+			paths_[_parent].child_count_++;
+		}
+
+		uint32_t index = (uint32_t)paths_.size() - 1;
+		path_index_[key] = index;
+		return index;
+	}
+
+	// objects get the path of the reference that found them first, which
+	// breadth first is one of the shortest from the roots
+	void Visit(const void *_child, const char *_name, size_t _name_len) {
+		uint32_t *found = index_.Find(_child);
+		if (found) {
+			edges_.push_back(*found);
+			return;
+		}
+
+		size_t size = 0;
+		int type = TypeIndex(LuaHeapObject(_child, &size));
+		uint32_t index = (uint32_t)objects_.size();
+		objects_.push_back(_child);
+		shallow_.push_back((uint32_t)size);
+		type_.push_back(type);
+		path_.push_back(PathIndex(path_[current_], _name, _name_len, type));
+		index_.Insert(_child, index);
+		edges_.push_back(index);
+	}
+
+	static void Visitor(const void *_child, const char *_name, size_t _name_len, void *_ud) {
+		((HeapGraph *)_ud)->Visit(_child, _name, _name_len);
+	}
+
+	void Walk(void) {
+		objects_.push_back(NULL);
+		shallow_.push_back(0);
+		type_.push_back(-1);
+		path_.push_back(kNoPath);
+
+		for (current_ = 0; current_ < objects_.size(); ++current_) {
+			edge_begin_.push_back((uint32_t)edges_.size());
+			LuaHeapEdges(L_, objects_[current_], Visitor, this);
+		}
+		edge_begin_.push_back((uint32_t)edges_.size());
+	}
+
+	// iterative so deep lists do not overflow the C stack
+	void PostOrder(vector<uint32_t> *_order) const {
+		vector<bool> visited(objects_.size(), false);
+		vector<pair<uint32_t, uint32_t> > stack;
+		stack.push_back(make_pair(0u, edge_begin_[0]));
+		visited[0] = true;
+		while (!stack.empty()) {
+			pair<uint32_t, uint32_t> &top = stack.back();
+			if (top.second < edge_begin_[top.first + 1]) {
+				uint32_t next = edges_[top.second++];
+				if (!visited[next]) {
+					visited[next] = true;
+					stack.push_back(make_pair(next, edge_begin_[next]));
+				}
+				continue;
+			}
+
+			_order->push_back(top.first);
+			stack.pop_back();
+		}
+	}
+
+	// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+	void Dominators(const vector<uint32_t> &_order, vector<uint32_t> *_idom) const {
+		size_t count = objects_.size();
+		vector<uint32_t> rank(count);
+		for (size_t i = 0; i < _order.size(); ++i) {
+			rank[_order[i]] = (uint32_t)i;
+		}
+
+		vector<uint32_t> pred_begin(count + 1, 0);
+		for (size_t i = 0; i < edges_.size(); ++i) {
+			pred_begin[edges_[i] + 1]++;
+		}
+		for (size_t i = 0; i < count; ++i) {
+			pred_begin[i + 1] += pred_begin[i];
+		}
+
+		vector<uint32_t> preds(edges_.size());
+		vector<uint32_t> fill(pred_begin.begin(), pred_begin.end() - 1);
+		for (uint32_t from = 0; from < count; ++from) {
+			for (uint32_t e = edge_begin_[from]; e < edge_begin_[from + 1]; ++e) {
+				preds[fill[edges_[e]]++] = from;
+			}
+		}
+
+		vector<uint32_t> &idom = *_idom;
+		idom.assign(count, kNoPath);
+		idom[0] = 0;
+		bool changed = true;
+		while (changed) {
+			changed = false;
+			for (size_t i = _order.size() - 1; i-- > 0;) {
+				uint32_t node = _order[i];
+				uint32_t new_idom = kNoPath;
+				for (uint32_t p = pred_begin[node]; p < pred_begin[node + 1]; ++p) {
+					uint32_t pred = preds[p];
+					if (idom[pred] == kNoPath) {
+						continue;
+					}
+
+					if (new_idom == kNoPath) {
+						new_idom = pred;
+						continue;
+					}
+
+					uint32_t a = pred;
+					uint32_t b = new_idom;
+					while (a != b) {
+						while (rank[a] < rank[b]) {
+							a = idom[a];
+						}
+						while (rank[b] < rank[a]) {
+							b = idom[b];
+						}
+					}
+					new_idom = a;
+				}
+
+				if (idom[node] != new_idom) {
+					idom[node] = new_idom;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	// a dominator finishes after everything it dominates, so one pass over
+	// the postorder rolls retained sizes up the dominator tree. a path is
+	// credited once per object whose dominator lies on another path, so
+	// folded subtrees are not counted twice
+	void Attribute(void) {
+		vector<uint32_t> order;
+		order.reserve(objects_.size());
+		PostOrder(&order);
+
+		vector<uint32_t> idom;
+		Dominators(order, &idom);
+
+		vector<uint64_t> retained(shallow_.begin(), shallow_.end());
+		for (size_t i = 0; i + 1 < order.size(); ++i) {
+			uint32_t node = order[i];
+			retained[idom[node]] += retained[node];
+		}
+
+		for (size_t node = 1; node < objects_.size(); ++node) {
+			HeapPath &path = paths_[path_[node]];
+			path.count_++;
+			path.shallow_ += shallow_[node];
+			if (path_[idom[node]] != path_[node]) {
+				path.retained_ += retained[node];
+			}
+
+			HeapType &type = types_[type_[node]];
+			type.count_++;
+			type.shallow_ += shallow_[node];
+		}
+	}
+};
+
+static void PutString(vector<uint8_t> *_out, const string &_str) {
+	PutVarint(_out, _str.size());
+	_out->insert(_out->end(), _str.begin(), _str.end());
+}
+
+static bool WriteFile(const char *_file_name, const vector<uint8_t> &_data) {
+	FILE *fp = fopen(_file_name, "wb");
+	if (!fp) {
+		return false;
+	}
+
+	bool ok = fwrite(_data.data(), 1, _data.size(), fp) == _data.size();
+	ok = fflush(fp) == 0 && ok;
+	fclose(fp);
+	return ok;
+}
+
+// walks the heap into _file_name. raises nothing, the graph and the buffer
+// must be gone before a lua error long jumps past them
+static bool WriteHeapSnapshot(lua_State *L, const char *_file_name, uint64_t *_objects, uint64_t *_bytes) {
+	uint64_t heap_bytes = (uint64_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+
+	// nothing below allocates lua memory, so the graph holds still
+	HeapGraph graph(L);
+	graph.Walk();
+	graph.Attribute();
+
+	uint64_t objects = graph.objects_.size() - 1;
+	uint64_t bytes = 0;
+	for (vector<HeapType>::const_iterator citr = graph.types_.begin(); citr != graph.types_.end(); ++citr) {
+		bytes += citr->shallow_;
+	}
+	*_objects = objects;
+	*_bytes = bytes;
+
+	vector<uint8_t> data(kHeapMagic, kHeapMagic + 4);
+	PutVarint(&data, kHeapVersion);
+	PutVarint(&data, (uint64_t)time(NULL));
+	PutVarint(&data, objects);
+	PutVarint(&data, bytes);
+	PutVarint(&data, heap_bytes);
+
+	PutVarint(&data, graph.types_.size());
+	for (vector<HeapType>::const_iterator citr = graph.types_.begin(); citr != graph.types_.end(); ++citr) {
+		PutString(&data, citr->name_);
+		PutVarint(&data, citr->count_);
+		PutVarint(&data, citr->shallow_);
+	}
+
+	PutVarint(&data, graph.paths_.size());
+	for (vector<HeapPath>::const_iterator citr = graph.paths_.begin(); citr != graph.paths_.end(); ++citr) {
+		PutVarint(&data, citr->parent_ + 1);
+		PutString(&data, citr->label_);
+		PutVarint(&data, (uint64_t)citr->type_);
+		PutVarint(&data, citr->count_);
+		PutVarint(&data, citr->shallow_);
+		PutVarint(&data, citr->retained_);
+	}
+
+	return WriteFile(_file_name, data);
+}
+
+// profiler.heap_snapshot(file_name), returns the number of reachable objects
+// and their total size. garbage is collected first so only live data counts
+int HeapSnapshot(lua_State *L) {
+	const char *file_name = luaL_checkstring(L, 1);
+
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	uint64_t objects = 0;
+	uint64_t bytes = 0;
+	if (!WriteHeapSnapshot(L, file_name, &objects, &bytes)) {
+		return luaL_error(L, "profiler file_name[%s] write error", file_name);
+	}
+
+	lua_pushinteger(L, (lua_Integer)objects);
+	lua_pushinteger(L, (lua_Integer)bytes);
+	return 2;
+}
+
+struct HeapEntry {
+	uint64_t count_;
+	uint64_t shallow_;
+	uint64_t retained_;
+};
+
+struct HeapFile {
+	uint64_t time_;
+	uint64_t objects_;
+	uint64_t bytes_;
+	uint64_t heap_bytes_;
+	map<string, HeapEntry> types_;
+	map<pair<string, string>, HeapEntry> paths_;	// (path, type)
+};
+
+// bounds checked reads, the buffer ends with a zero byte so a truncated
+// varint stops there and shows up as overrun
+struct HeapReader {
+	const uint8_t *pos_;
+	const uint8_t *end_;
+	bool ok_;
+
+	uint64_t Varint(void) {
+		if (!ok_ || pos_ >= end_) {
+			ok_ = false;
+			return 0;
+		}
+
+		uint64_t value = GetVarint(pos_);
+		ok_ = pos_ <= end_;
+		return value;
+	}
+
+	string String(void) {
+		uint64_t len = Varint();
+		if (!ok_ || len > (uint64_t)(end_ - pos_)) {
+			ok_ = false;
+			return string();
+		}
+
+		string str((const char *)pos_, (size_t)len);
+		pos_ += len;
+		return str;
+	}
+};
+
+static bool ReadFile(const char *_file_name, vector<uint8_t> *_data) {
+	FILE *fp = fopen(_file_name, "rb");
+	if (!fp) {
+		return false;
+	}
+
+	uint8_t buf[4096];
+	size_t count;
+	while ((count = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		_data->insert(_data->end(), buf, buf + count);
+	}
+	bool ok = !ferror(fp);
+	fclose(fp);
+	return ok;
+}
+
+static bool ParseHeapFile(const vector<uint8_t> &_data, HeapFile *_file) {
+	if (_data.size() < 5 || memcmp(_data.data(), kHeapMagic, 4) != 0) {
+		return false;
+	}
+
+	HeapReader reader;
+	reader.pos_ = _data.data() + 4;
+	reader.end_ = _data.data() + _data.size() - 1;
+	reader.ok_ = true;
+	if (reader.Varint() != kHeapVersion) {
+		return false;
+	}
+
+	_file->time_ = reader.Varint();
+	_file->objects_ = reader.Varint();
+	_file->bytes_ = reader.Varint();
+	_file->heap_bytes_ = reader.Varint();
+
+	vector<string> type_names;
+	uint64_t type_count = reader.Varint();
+	for (uint64_t i = 0; i < type_count && reader.ok_; ++i) {
+		type_names.push_back(reader.String());
+		HeapEntry &entry = _file->types_[type_names.back()];
+		entry.count_ = reader.Varint();
+		entry.shallow_ = reader.Varint();
+		entry.retained_ = 0;
+	}
+
+	vector<string> names;
+	uint64_t path_count = reader.Varint();
+	for (uint64_t i = 0; i < path_count && reader.ok_; ++i) {
+		uint64_t parent = reader.Varint();
+		string label = reader.String();
+		uint64_t type = reader.Varint();
+		if (parent > names.size() || type >= type_names.size()) {
+			return false;
+		}
+
+		string name;
+		if (parent == 0) {
+			name = label;
+		} else if (label == "[]") {
+			name = names[parent - 1] + label;
+		} else {
+			name = names[parent - 1] + "." + label;
+		}
+		names.push_back(name);
+
+		// the same name can come from differently typed parents
+		HeapEntry &entry = _file->paths_[make_pair(name, type_names[type])];
+		entry.count_ += reader.Varint();
+		entry.shallow_ += reader.Varint();
+		entry.retained_ += reader.Varint();
+	}
+
+	return reader.ok_ && reader.pos_ == reader.end_;
+}
+
+enum HeapError {
+	kHeapOk,
+	kHeapOpenError,
+	kHeapFormatError,
+};
+
+static HeapError LoadHeapFile(const char *_file_name, HeapFile *_file) {
+	vector<uint8_t> data;
+	if (!ReadFile(_file_name, &data)) {
+		return kHeapOpenError;
+	}
+
+	data.push_back(0);
+	if (!ParseHeapFile(data, _file)) {
+		return kHeapFormatError;
+	}
+
+	return kHeapOk;
+}
+
+static void PrintJsonString(FILE *fp, const string &_str) {
+	fputc('\'', fp);
+	for (string::const_iterator citr = _str.begin(); citr != _str.end(); ++citr) {
+		unsigned char c = (unsigned char)*citr;
+		if (c == '\'' || c == '\\') {
+			fprintf(fp, "\\%c", c);
+		} else if (c < 0x20 || c >= 0x7f) {
+			fprintf(fp, "\\u%04x", c);
+		} else {
+			fputc(c, fp);
+		}
+	}
+	fputc('\'', fp);
+}
+
+static void PrintHeader(FILE *fp, const char *_name, const HeapFile &_file) {
+	fprintf(fp, "'%s':{'time':%lu,'objects':%lu,'bytes':%lu,'heapBytes':%lu},",
+		_name, _file.time_, _file.objects_, _file.bytes_, _file.heap_bytes_);
+}
+
+struct HeapDelta {
+	string path_;
+	string type_;
+	HeapEntry before_;
+	HeapEntry after_;
+
+	int64_t RetainedDelta(void) const {
+		return (int64_t)(after_.retained_ - before_.retained_);
+	}
+
+	bool operator<(const HeapDelta &_other) const {
+		return RetainedDelta() > _other.RetainedDelta();
+	}
+};
+
+// like WriteHeapSnapshot it raises nothing, _error_name is the file that failed
+static HeapError WriteHeapDiff(const char *_before_name, const char *_after_name, const char *_file_name,
+	const char **_error_name, size_t *_changed) {
+	HeapFile before;
+	HeapFile after;
+	*_error_name = _before_name;
+	HeapError error = LoadHeapFile(_before_name, &before);
+	if (error != kHeapOk) {
+		return error;
+	}
+
+	*_error_name = _after_name;
+	error = LoadHeapFile(_after_name, &after);
+	if (error != kHeapOk) {
+		return error;
+	}
+
+	static const HeapEntry kEmpty = {0, 0, 0};
+	vector<HeapDelta> deltas;
+	typedef map<pair<string, string>, HeapEntry> PathMap;
+	for (PathMap::const_iterator citr = after.paths_.begin(); citr != after.paths_.end(); ++citr) {
+		PathMap::const_iterator found = before.paths_.find(citr->first);
+		HeapDelta delta;
+		delta.path_ = citr->first.first;
+		delta.type_ = citr->first.second;
+		delta.before_ = found != before.paths_.end() ? found->second : kEmpty;
+		delta.after_ = citr->second;
+		if (delta.before_.count_ != delta.after_.count_ || delta.before_.shallow_ != delta.after_.shallow_
+			|| delta.before_.retained_ != delta.after_.retained_) {
+			deltas.push_back(delta);
+		}
+	}
+	for (PathMap::const_iterator citr = before.paths_.begin(); citr != before.paths_.end(); ++citr) {
+		if (after.paths_.find(citr->first) == after.paths_.end()) {
+			HeapDelta delta;
+			delta.path_ = citr->first.first;
+			delta.type_ = citr->first.second;
+			delta.before_ = citr->second;
+			delta.after_ = kEmpty;
+			deltas.push_back(delta);
+		}
+	}
+	stable_sort(deltas.begin(), deltas.end());
+
+	*_error_name = _file_name;
+	FILE *fp = fopen(_file_name, "w+");
+	if (!fp) {
+		return kHeapOpenError;
+	}
+
+	fprintf(fp, "{");
+	PrintHeader(fp, "before", before);
+	PrintHeader(fp, "after", after);
+
+	fprintf(fp, "'type':[");
+	typedef map<string, HeapEntry> TypeMap;
+	for (TypeMap::const_iterator citr = after.types_.begin(); citr != after.types_.end(); ++citr) {
+		TypeMap::const_iterator found = before.types_.find(citr->first);
+		const HeapEntry &prev = found != before.types_.end() ? found->second : kEmpty;
+		fprintf(fp, "{'type':'%s','count':%lu,'bytes':%lu,'countDelta':%ld,'bytesDelta':%ld},",
+			citr->first.c_str(), citr->second.count_, citr->second.shallow_,
+			(int64_t)(citr->second.count_ - prev.count_), (int64_t)(citr->second.shallow_ - prev.shallow_));
+	}
+	fprintf(fp, "],");
+
+	fprintf(fp, "'path':[");
+	for (vector<HeapDelta>::const_iterator citr = deltas.begin(); citr != deltas.end(); ++citr) {
+		fprintf(fp, "{'path':");
+		PrintJsonString(fp, citr->path_);
+		fprintf(fp, ",'type':'%s','count':%lu,'shallow':%lu,'retained':%lu,'countDelta':%ld,'shallowDelta':%ld,'retainedDelta':%ld},",
+			citr->type_.c_str(), citr->after_.count_, citr->after_.shallow_, citr->after_.retained_,
+			(int64_t)(citr->after_.count_ - citr->before_.count_),
+			(int64_t)(citr->after_.shallow_ - citr->before_.shallow_),
+			citr->RetainedDelta());
+	}
+	fprintf(fp, "]}");
+	fflush(fp);
+	fclose(fp);
+
+	*_changed = deltas.size();
+	return kHeapOk;
+}
+
+// profiler.heap_diff(before, after, file_name), writes what changed between
+// two heap snapshots, paths sorted by retained growth. returns the number of
+// paths that changed
+int HeapDiff(lua_State *L) {
+	const char *before_name = luaL_checkstring(L, 1);
+	const char *after_name = luaL_checkstring(L, 2);
+	const char *file_name = luaL_checkstring(L, 3);
+
+	const char *error_name = NULL;
+	size_t changed = 0;
+	switch (WriteHeapDiff(before_name, after_name, file_name, &error_name, &changed)) {
+	case kHeapOpenError:
+		return luaL_error(L, "profiler file_name[%s] open error", error_name);
+	case kHeapFormatError:
+		return luaL_error(L, "profiler heap snapshot[%s] bad format", error_name);
+	default:
+		break;
+	}
+
+	lua_pushinteger(L, (lua_Integer)changed);
+	return 1;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "lua.hpp"
+
+int HeapSnapshot(lua_State *L);
+int HeapDiff(lua_State *L);
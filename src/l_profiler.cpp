@@ -1,12 +1,33 @@
 #include <lua.hpp>
 
 #include "core_profiler.h"
+#include "heap_snapshot.h"
 
 static int lstart(lua_State *L) {
 	ProfilerStart(L);
 	return 0;
 }
 
+static int lstop(lua_State *L) {
+	ProfilerStop(L);
+	return 0;
+}
+
+static int lpause(lua_State *L) {
+	ProfilerPause(L);
+	return 0;
+}
+
+static int lresume(lua_State *L) {
+	ProfilerResume(L);
+	return 0;
+}
+
+static int lreset(lua_State *L) {
+	ProfilerReset(L);
+	return 0;
+}
+
 static int ldump(lua_State *L) {
 	ProfilerDump(L);
 	return 0;
@@ -18,8 +39,27 @@ static int lcoroutine_create(lua_State *L) {
 }
 
 static int lrecord_save(lua_State *L) {
-	RecordSave(L);
-	return 0;
+	return RecordSave(L);
+}
+
+static int lrecord_list(lua_State *L) {
+	return RecordList(L);
+}
+
+static int lclock_bench(lua_State *L) {
+	return ClockBench(L);
+}
+
+static int lline_dump(lua_State *L) {
+	return LineDump(L);
+}
+
+static int lheap_snapshot(lua_State *L) {
+	return HeapSnapshot(L);
+}
+
+static int lheap_diff(lua_State *L) {
+	return HeapDiff(L);
 }
 
 extern "C"
@@ -27,9 +67,18 @@ int luaopen_profiler_c(lua_State *L) {
 	luaL_checkversion(L);
 	luaL_Reg l[] = {
 		{"start", lstart},
+		{"stop", lstop},
+		{"pause", lpause},
+		{"resume", lresume},
+		{"reset", lreset},
 		{"dump", ldump},
 		{"coroutine_create", lcoroutine_create},
 		{"record_save", lrecord_save},
+		{"record_list", lrecord_list},
+		{"clock_bench", lclock_bench},
+		{"line_dump", lline_dump},
+		{"heap_snapshot", lheap_snapshot},
+		{"heap_diff", lheap_diff},
 		{NULL, NULL}
 	};
 
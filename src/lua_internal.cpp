@@ -0,0 +1,298 @@
+#include <string.h>
+
+extern "C" {
+#include "lstate.h"
+#include "lobject.h"
+#include "lfunc.h"
+#include "lstring.h"
+#include "ltable.h"
+#include "ltm.h"
+}
+
+#include "lua_internal.h"
+
+lua_State *LuaRunningThread(lua_State *L) {
+	return G(L)->running;
+}
+
+// the main thread plus every thread on the allgc list, dead ones not swept yet included
+void LuaForeachThread(lua_State *L, LuaThreadVisitor _visitor, void *_ud) {
+	global_State *g = G(L);
+	_visitor(g->mainthread, _ud);
+	for (GCObject *o = g->allgc; o; o = o->next) {
+		if (o->tt == LUA_TTHREAD) {
+			_visitor(gco2th(o), _ud);
+		}
+	}
+}
+
+// depth of the frame a hook fires for, numbered like profcall: a tail call
+// hook fires before the new frame is moved down onto the one it replaces
+int LuaHookDepth(const lua_Debug *_ar) {
+	const CallInfo *ci = _ar->i_ci;
+	return _ar->event == LUA_HOOKTAILCALL ? ci->previous->depth : ci->depth;
+}
+
+// depth of the frame running on L
+int LuaCallDepth(lua_State *L) {
+	return L->ci->depth;
+}
+
+// fills _frames[depth] for every frame of L shallower than _count, reads
+// live VM structures so it is not for signal handlers
+void LuaStackFrames(lua_State *L, StackFrame *_frames, int _count) {
+	for (CallInfo *ci = L->ci; ci && ci != &L->base_ci; ci = ci->previous) {
+		if (ci->depth >= _count) {
+			continue;
+		}
+
+		const TValue *func = ci->func;
+		StackFrame *frame = &_frames[ci->depth];
+		switch (ttype(func)) {
+		case LUA_TLCL:
+			frame->func_ = clLvalue(func);
+			frame->proto_ = clLvalue(func)->p;
+			break;
+		case LUA_TLCF:
+			frame->func_ = (const void *)fvalue(func);
+			frame->proto_ = NULL;
+			break;
+		case LUA_TCCL:
+			frame->func_ = (const void *)clCvalue(func)->f;
+			frame->proto_ = NULL;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+const void *LuaFunctionProto(lua_State *L, int _index) {
+	const void *f = lua_topointer(L, _index);
+	if (lua_type(L, _index) != LUA_TFUNCTION || lua_iscfunction(L, _index)) {
+		return NULL;
+	}
+
+	return ((const LClosure *)f)->p;
+}
+
+void LuaFunctionId(lua_State *L, int _index, FunctionId *_id) {
+	lua_CFunction f = lua_tocfunction(L, _index);
+	if (f) {
+		CFunctionId((const void *)f, _id);
+	} else {
+		LuaProtoId(((const LClosure *)lua_topointer(L, _index))->p, _id);
+	}
+}
+
+void LuaProtoId(const void *_proto, FunctionId *_id) {
+	const Proto *p = (const Proto *)_proto;
+	_id->key_ = p;
+	_id->source_ = p->source;
+	_id->linedefined_ = p->linedefined;
+}
+
+// what the run marked _mark left on the Proto, NULL for any other run
+void *LuaProtoData(const void *_proto, unsigned int _mark) {
+	const Proto *p = (const Proto *)_proto;
+	return p->profmark == _mark ? p->profdata : NULL;
+}
+
+void LuaSetProtoData(const void *_proto, unsigned int _mark, void *_data) {
+	Proto *p = (Proto *)_proto;
+	p->profdata = _data;
+	p->profmark = _mark;
+}
+
+void LuaProtoInfo(const void *_proto, const char **_source, int *_linedefined) {
+	const Proto *p = (const Proto *)_proto;
+	*_source = p->source ? getstr(p->source) : "=?";
+	*_linedefined = p->linedefined;
+}
+
+// type name and own size of a collectable object, sized the way the
+// collector frees it
+const char *LuaHeapObject(const void *_object, size_t *_size) {
+	GCObject *o = (GCObject *)_object;
+	switch (o->tt) {
+	case LUA_TSHRSTR:
+	case LUA_TLNGSTR:
+		*_size = sizelstring(tsslen(gco2ts(o)));
+		return "string";
+	case LUA_TTABLE: {
+		Table *h = gco2t(o);
+		*_size = sizeof(Table) + sizeof(TValue) * h->sizearray + (isdummy(h) ? 0 : sizeof(Node) * sizenode(h));
+		return "table";
+	}
+	case LUA_TLCL:
+		*_size = sizeLclosure(gco2lcl(o)->nupvalues);
+		return "function";
+	case LUA_TCCL:
+		*_size = sizeCclosure(gco2ccl(o)->nupvalues);
+		return "function";
+	case LUA_TUSERDATA:
+		*_size = sizeudata(gco2u(o));
+		return "userdata";
+	case LUA_TTHREAD: {
+		lua_State *L1 = gco2th(o);
+		*_size = LUA_EXTRASPACE + sizeof(lua_State) + sizeof(TValue) * L1->stacksize + sizeof(CallInfo) * L1->nci;
+		return "thread";
+	}
+	case LUA_TPROTO: {
+		Proto *p = gco2p(o);
+		*_size = sizeof(Proto) + sizeof(Instruction) * p->sizecode + sizeof(Proto *) * p->sizep
+			+ sizeof(TValue) * p->sizek + sizeof(int) * p->sizelineinfo
+			+ sizeof(LocVar) * p->sizelocvars + sizeof(Upvaldesc) * p->sizeupvalues;
+		return "proto";
+	}
+	default:
+		*_size = 0;
+		return "?";
+	}
+}
+
+static inline void VisitValue(const TValue *_value, const char *_name, LuaHeapVisitor _visitor, void *_ud) {
+	if (iscollectable(_value)) {
+		_visitor(gcvalue(_value), _name, strlen(_name), _ud);
+	}
+}
+
+static inline void VisitObject(const void *_object, const char *_name, LuaHeapVisitor _visitor, void *_ud) {
+	if (_object) {
+		_visitor(_object, _name, strlen(_name), _ud);
+	}
+}
+
+// luaT_gettm is not exported, short strings are interned so a pointer
+// compare finds the key
+static const TValue *MetaField(lua_State *L, Table *_mt, TMS _event) {
+	if (!_mt || isdummy(_mt)) {
+		return NULL;
+	}
+
+	TString *name = G(L)->tmname[_event];
+	for (Node *n = gnode(_mt, 0), *limit = gnode(_mt, cast(size_t, sizenode(_mt))); n < limit; ++n) {
+		if (ttisshrstring(gkey(n)) && tsvalue(gkey(n)) == name && !ttisnil(gval(n))) {
+			return gval(n);
+		}
+	}
+	return NULL;
+}
+
+// strong references only: weak keys and weak values of a table are skipped
+static void VisitTable(lua_State *L, Table *h, LuaHeapVisitor _visitor, void *_ud) {
+	VisitObject(h->metatable, "(metatable)", _visitor, _ud);
+
+	const TValue *mode = MetaField(L, h->metatable, TM_MODE);
+	bool weak_key = mode && ttisstring(mode) && strchr(svalue(mode), 'k');
+	bool weak_value = mode && ttisstring(mode) && strchr(svalue(mode), 'v');
+
+	if (!weak_value) {
+		for (unsigned int i = 0; i < h->sizearray; ++i) {
+			VisitValue(&h->array[i], "[]", _visitor, _ud);
+		}
+	}
+
+	if (isdummy(h)) {
+		return;
+	}
+
+	for (Node *n = gnode(h, 0), *limit = gnode(h, cast(size_t, sizenode(h))); n < limit; ++n) {
+		const TValue *key = gkey(n);
+		const TValue *value = gval(n);
+		if (ttisnil(value)) {
+			continue;
+		}
+
+		if (!weak_key) {
+			VisitValue(key, "(key)", _visitor, _ud);
+		}
+
+		if (!weak_value && iscollectable(value)) {
+			if (ttisstring(key)) {
+				_visitor(gcvalue(value), svalue(key), vslen(key), _ud);
+			} else {
+				_visitor(gcvalue(value), "[]", 2, _ud);
+			}
+		}
+	}
+}
+
+// _object NULL visits the roots: globals, the main thread, the registry
+// and the metatables of the basic types
+void LuaHeapEdges(lua_State *L, const void *_object, LuaHeapVisitor _visitor, void *_ud) {
+	global_State *g = G(L);
+	if (!_object) {
+		Table *registry = hvalue(&g->l_registry);
+		if (registry->sizearray >= LUA_RIDX_GLOBALS) {
+			VisitValue(&registry->array[LUA_RIDX_GLOBALS - 1], "globals", _visitor, _ud);
+		}
+		VisitObject(g->mainthread, "mainthread", _visitor, _ud);
+		VisitObject(registry, "registry", _visitor, _ud);
+		for (int i = 0; i < LUA_NUMTAGS; ++i) {
+			VisitObject(g->mt[i], "(metatable)", _visitor, _ud);
+		}
+		return;
+	}
+
+	GCObject *o = (GCObject *)_object;
+	switch (o->tt) {
+	case LUA_TTABLE:
+		VisitTable(L, gco2t(o), _visitor, _ud);
+		break;
+	case LUA_TLCL: {
+		LClosure *cl = gco2lcl(o);
+		VisitObject(cl->p, "(proto)", _visitor, _ud);
+		for (int i = 0; i < cl->nupvalues; ++i) {
+			if (!cl->upvals[i]) {
+				continue;
+			}
+
+			TString *name = cl->p && i < cl->p->sizeupvalues ? cl->p->upvalues[i].name : NULL;
+			VisitValue(cl->upvals[i]->v, name ? getstr(name) : "(upvalue)", _visitor, _ud);
+		}
+		break;
+	}
+	case LUA_TCCL: {
+		CClosure *cl = gco2ccl(o);
+		for (int i = 0; i < cl->nupvalues; ++i) {
+			VisitValue(&cl->upvalue[i], "(upvalue)", _visitor, _ud);
+		}
+		break;
+	}
+	case LUA_TUSERDATA: {
+		Udata *u = gco2u(o);
+		TValue uservalue;
+		VisitObject(u->metatable, "(metatable)", _visitor, _ud);
+		getuservalue(L, u, &uservalue);
+		VisitValue(&uservalue, "(uservalue)", _visitor, _ud);
+		break;
+	}
+	case LUA_TTHREAD: {
+		lua_State *L1 = gco2th(o);
+		for (StkId value = L1->stack; value < L1->top; ++value) {
+			VisitValue(value, "(stack)", _visitor, _ud);
+		}
+		break;
+	}
+	case LUA_TPROTO: {
+		Proto *p = gco2p(o);
+		VisitObject(p->source, "(source)", _visitor, _ud);
+		for (int i = 0; i < p->sizek; ++i) {
+			VisitValue(&p->k[i], "(constant)", _visitor, _ud);
+		}
+		for (int i = 0; i < p->sizep; ++i) {
+			VisitObject(p->p[i], "(proto)", _visitor, _ud);
+		}
+		for (int i = 0; i < p->sizeupvalues; ++i) {
+			VisitObject(p->upvalues[i].name, "(debug)", _visitor, _ud);
+		}
+		for (int i = 0; i < p->sizelocvars; ++i) {
+			VisitObject(p->locvars[i].varname, "(debug)", _visitor, _ud);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "lua.hpp"
+
+struct StackFrame {
+	const void *func_;
+	const void *proto_;
+};
+
+struct FunctionId {
+	const void *key_;		// Proto for lua functions, lua_CFunction for C functions
+	const void *source_;	// source string of the Proto, catches address reuse
+	int linedefined_;
+};
+
+typedef void (*LuaThreadVisitor)(lua_State *L1, void *_ud);
+
+// one reference of the heap graph, _name is not NUL terminated
+typedef void (*LuaHeapVisitor)(const void *_child, const char *_name, size_t _name_len, void *_ud);
+
+inline void CFunctionId(const void *_f, FunctionId *_id) {
+	_id->key_ = _f;
+	_id->source_ = NULL;
+	_id->linedefined_ = -1;
+}
+
+lua_State *LuaRunningThread(lua_State *L);
+void LuaForeachThread(lua_State *L, LuaThreadVisitor _visitor, void *_ud);
+int LuaHookDepth(const lua_Debug *_ar);
+int LuaCallDepth(lua_State *L);
+void LuaStackFrames(lua_State *L, StackFrame *_frames, int _count);
+const void *LuaFunctionProto(lua_State *L, int _index);
+void LuaFunctionId(lua_State *L, int _index, FunctionId *_id);
+void LuaProtoId(const void *_proto, FunctionId *_id);
+void *LuaProtoData(const void *_proto, unsigned int _mark);
+void LuaSetProtoData(const void *_proto, unsigned int _mark, void *_data);
+void LuaProtoInfo(const void *_proto, const char **_source, int *_linedefined);
+const char *LuaHeapObject(const void *_object, size_t *_size);
+void LuaHeapEdges(lua_State *L, const void *_object, LuaHeapVisitor _visitor, void *_ud);
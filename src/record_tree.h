@@ -0,0 +1,542 @@
+#pragma once
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "stack.h"
+#include "clocks.h"
+#include "hash_map.h"
+
+using namespace std;
+
+struct FunctionInfo {
+	string name_;
+	string source_;
+	int linedefined_;
+	const void *source_id_;
+	bool filtered_;
+	vector<uint64_t> line_count_;	// indexed by currentline - linedefined, line mode only
+	vector<uint64_t> line_elapse_;
+
+	FunctionInfo(const char *_name, const char *_source, int _line)
+		: name_(_name ? _name : "?")
+		, linedefined_(_line)
+		, source_id_(NULL)
+		, filtered_(false) {
+		if (_source) {
+			if (_source[0] == '@' || _source[0] == '=') {
+				source_ = _source;
+			} else {
+				source_ = "(string)";
+			}
+		}
+	}
+
+	inline void AddLineHit(int _index) {
+		if ((size_t)_index >= line_count_.size()) {
+			line_count_.resize(_index + 1, 0);
+			line_elapse_.resize(_index + 1, 0);
+		}
+		line_count_[_index]++;
+	}
+
+	// the line was hit before, so the arrays already cover it
+	inline void AddLineElapse(int _index, uint64_t _elapse) {
+		line_elapse_[_index] += _elapse;
+	}
+
+	void ResetLines(void) {
+		fill(line_count_.begin(), line_count_.end(), 0);
+		fill(line_elapse_.begin(), line_elapse_.end(), 0);
+	}
+};
+
+// per record counters, stored column by column. the columns before
+// kRecordAllocCount are kept by every tree, the rest only when an option asks
+enum RecordColumn {
+	kRecordCallCount,
+	kRecordInnerElapse,
+	kRecordContaminatedElapse,	// part of inner elapse that crossed cpus or looked preempted
+	kRecordMigrateCount,
+	kRecordPreemptCount,
+	kRecordAllocCount,		// blocks allocated or grown while the record was running
+	kRecordAllocBytes,
+	kRecordFreeBytes,
+	kRecordAllocTable,		// allocated bytes by object type
+	kRecordAllocString,
+	kRecordAllocFunction,
+	kRecordAllocUserdata,
+	kRecordAllocOther,		// arrays, buffers, grown blocks and the rest
+	kRecordColumnCount,
+};
+
+static const uint32_t kRecordCoreColumns = (1u << kRecordAllocCount) - 1;
+static const uint32_t kRecordAllocColumns = ((1u << (kRecordAllocOther + 1)) - 1) & ~kRecordCoreColumns;
+
+typedef ColumnBuffer<kRecordColumnCount> RecordBuffer;
+typedef RecordBuffer::Snapshot RecordCopy;
+
+typedef uint32_t RecordId;
+static const RecordId kNullRecordId = 0xffffffff;
+static const RecordId kRootRecordId = 0;
+
+// hot part of a call tree node, touched on every call entry
+struct Record {
+	static const size_t kInlineChildCount = 4;
+	static const size_t kChildrenMapInitCount = 16;
+
+	typedef PtrHashMap<RecordId> ChildrenMap;
+
+	FunctionInfo *func_info_;
+	uint64_t *data_;	// column 0 of this record in the RecordBuffer, core columns sit at their id
+	FunctionInfo *last_info_;
+	RecordId last_child_;
+	RecordId id_;
+	uint32_t child_count_;
+	RecordId inline_children_[kInlineChildCount];
+	ChildrenMap *children_map_;	// only for wide fan-out
+
+	Record(FunctionInfo *_info, RecordId _id, uint64_t *_data)
+		: func_info_(_info)
+		, data_(_data)
+		, last_info_(NULL)
+		, last_child_(kNullRecordId)
+		, id_(_id)
+		, child_count_(0)
+		, children_map_(NULL) {}
+
+	~Record(void) {
+		delete children_map_;
+		children_map_ = NULL;
+	}
+
+	inline void AddCount(void) {
+		data_[kRecordCallCount * RecordBuffer::kChunkRows]++;
+	}
+
+	inline void AddInnerElapse(uint64_t elapse) {
+		data_[kRecordInnerElapse * RecordBuffer::kChunkRows] += elapse;
+	}
+
+	inline void AddContaminated(uint64_t elapse, RecordColumn _reason) {
+		data_[kRecordContaminatedElapse * RecordBuffer::kChunkRows] += elapse;
+		data_[_reason * RecordBuffer::kChunkRows]++;
+	}
+
+	inline RecordId FindChild(FunctionInfo *_info) {
+		if (children_map_) {
+			RecordId *id = children_map_->Find(_info);
+			return id ? *id : kNullRecordId;
+		}
+
+		return kNullRecordId;
+	}
+};
+
+// collector time indexed by LUA_GCPHASE*: propagate, atomic, sweep, callfin.
+// kept beside the tree since only the gc records have it
+struct GcPhaseElapse {
+	static const int kPhaseCount = 4;
+
+	uint64_t elapse_[kPhaseCount];
+
+	GcPhaseElapse(void) {
+		memset(elapse_, 0, sizeof(elapse_));
+	}
+};
+
+// cold part, only walked when dumping
+struct RecordLink {
+	RecordId first_child_;
+	RecordId next_sibling_;
+
+	RecordLink(void)
+		: first_child_(kNullRecordId)
+		, next_sibling_(kNullRecordId) {}
+};
+
+class RecordTree {
+	static const size_t kGcPhaseMapInitCount = 8;
+
+	typedef ChunkArena<Record> RecordArena;
+	typedef ChunkArena<RecordLink> RecordLinkArena;
+	typedef vector<RecordId> RecordIdList;
+	typedef vector<uint64_t> ElapseList;
+	typedef PtrHashMap<GcPhaseElapse> GcPhaseMap;	// keyed by Record
+
+	struct RecordSort {
+		const uint64_t *full_elapse_;
+
+		RecordSort(const uint64_t *_full_elapse) : full_elapse_(_full_elapse) {}
+
+		bool operator() (RecordId t1, RecordId t2) {
+			return full_elapse_[t1] > full_elapse_[t2];
+		}
+	};
+
+public:
+	typedef SnapshotRing<kRecordColumnCount> RecordRing;
+	typedef RecordRing::Entry RecordEntry;
+
+	// _columns picks the optional columns, the core ones are always kept,
+	// _ns_per_tick converts the elapse columns on dump
+	RecordTree(int _keep, int _stride, int _capacity, int _keyframe, uint32_t _columns, double _ns_per_tick)
+		: buffer_(_columns | kRecordCoreColumns)
+		, snapshots_(_keep, _stride, _capacity, _keyframe, _columns | kRecordCoreColumns)
+		, gc_phases_(kGcPhaseMapInitCount)
+		, window_(false)
+		, ns_per_tick_(_ns_per_tick)
+		, compensated_(false)
+		, overhead_parent_(0)
+		, overhead_child_(0) {
+		NewRecord(NULL, kNullRecordId);
+	}
+
+	inline Record *Root(void) {
+		return records_.At(kRootRecordId);
+	}
+
+	inline size_t Size(void) const {
+		return parents_.size();
+	}
+
+	inline Record *At(RecordId _id) {
+		return records_.At(_id);
+	}
+
+	inline RecordId Parent(RecordId _id) const {
+		return parents_[_id];
+	}
+
+	inline RecordLink *Link(RecordId _id) {
+		return links_.At(_id);
+	}
+
+	inline RecordBuffer &Buffer(void) {
+		return buffer_;
+	}
+
+	// optional columns move with the mask, so they are written through the buffer
+	inline void AddAlloc(Record *_record, uint64_t _bytes, RecordColumn _type) {
+		_record->data_[buffer_.Offset(kRecordAllocCount)]++;
+		_record->data_[buffer_.Offset(kRecordAllocBytes)] += _bytes;
+		_record->data_[buffer_.Offset(_type)] += _bytes;
+	}
+
+	inline void AddFree(Record *_record, uint64_t _bytes) {
+		_record->data_[buffer_.Offset(kRecordFreeBytes)] += _bytes;
+	}
+
+	inline void AddGcElapse(Record *_record, uint64_t _elapse, int _phase) {
+		GcPhaseElapse *phases = gc_phases_.Find(_record);
+		if (!phases) {
+			phases = gc_phases_.Insert(_record, GcPhaseElapse());
+		}
+		phases->elapse_[_phase] += _elapse;
+	}
+
+	inline const RecordRing &Snapshots(void) const {
+		return snapshots_;
+	}
+
+	uint64_t Save(uint64_t _time, const char *_label) {
+		buffer_.Capture(snapshots_.Current());
+		return snapshots_.Push(_time, _label);
+	}
+
+	void Reset(void) {
+		buffer_.Zero();
+		gc_phases_.Clear();
+		snapshots_.Clear();
+	}
+
+	inline const RecordCopy *StartSnapshot(uint64_t _seq) {
+		return snapshots_.Load(_seq, &start_copy_);
+	}
+
+	inline const RecordCopy *EndSnapshot(uint64_t _seq) {
+		return snapshots_.Load(_seq, &end_copy_);
+	}
+
+	inline Record *GetChildRecord(Record *_parent, FunctionInfo *_info) {
+		// consecutive calls mostly enter the same child
+		if (_parent->last_info_ == _info) {
+			return records_.At(_parent->last_child_);
+		}
+
+		RecordId id = kNullRecordId;
+		if (_parent->children_map_) {
+			id = _parent->FindChild(_info);
+		} else {
+			for (uint32_t i = 0; i < _parent->child_count_; ++i) {
+				RecordId child = _parent->inline_children_[i];
+				if (records_.At(child)->func_info_ == _info) {
+					id = child;
+					break;
+				}
+			}
+		}
+
+		if (id == kNullRecordId) {
+			id = AddChildRecord(_parent, _info);
+		}
+
+		_parent->last_info_ = _info;
+		_parent->last_child_ = id;
+		return records_.At(id);
+	}
+
+	// live counters when _end_record is NULL, otherwise the (_start_record, _end_record] window
+	uint64_t CalcRecord(const RecordCopy *_start_record, const RecordCopy *_end_record) {
+		uint64_t full_elapse = Aggregate(_start_record, _end_record);
+		SortRecords();
+		return full_elapse;
+	}
+
+	// the counters and subtree sums of CalcRecord, children left in insertion order
+	uint64_t Aggregate(const RecordCopy *_start_record, const RecordCopy *_end_record) {
+		if (_end_record) {
+			values_.Diff(_start_record, _end_record);
+		} else {
+			buffer_.Capture(&values_);
+		}
+		window_ = _end_record != NULL;
+		compensated_ = false;
+
+		// children always have larger ids than their parent, one backward pass sums subtrees
+		size_t count = parents_.size();
+		full_elapse_.resize(count);
+		for (size_t i = 0; i < count; ++i) {
+			full_elapse_[i] = values_.Get(kRecordInnerElapse, i);
+		}
+		for (size_t i = count - 1; i > 0; --i) {
+			full_elapse_[parents_[i]] += full_elapse_[i];
+		}
+
+		return full_elapse_[kRootRecordId];
+	}
+
+	// orders every child list by the full elapse of the last Aggregate
+	void SortRecords(void) {
+		for (size_t i = 0; i < parents_.size(); ++i) {
+			SortChildren((RecordId)i);
+		}
+	}
+
+	inline uint64_t CallCount(RecordId _id) const {
+		return values_.Get(kRecordCallCount, _id);
+	}
+
+	inline uint64_t InnerElapse(RecordId _id) const {
+		return values_.Get(kRecordInnerElapse, _id);
+	}
+
+	inline uint64_t FullElapse(RecordId _id) const {
+		return full_elapse_[_id];
+	}
+
+	inline uint64_t Value(RecordColumn _column, RecordId _id) const {
+		return values_.Get(_column, _id);
+	}
+
+	// takes the calibrated profiler cost back out of self times: _child_cost
+	// per call of the record itself, _parent_cost per call it made to a child
+	void Compensate(double _parent_cost, double _child_cost) {
+		compensated_ = true;
+		overhead_parent_ = _parent_cost;
+		overhead_child_ = _child_cost;
+
+		size_t count = parents_.size();
+		child_calls_.assign(count, 0);
+		for (size_t i = 1; i < count; ++i) {
+			child_calls_[parents_[i]] += values_.Get(kRecordCallCount, i);
+		}
+
+		comp_full_.resize(count);
+		for (size_t i = 0; i < count; ++i) {
+			double cost = values_.Get(kRecordCallCount, i) * _child_cost + child_calls_[i] * _parent_cost;
+			double self = (double)values_.Get(kRecordInnerElapse, i);
+			comp_full_[i] = self > cost ? (uint64_t)(self - cost) : 0;
+		}
+		comp_self_ = comp_full_;
+		for (size_t i = count - 1; i > 0; --i) {
+			comp_full_[parents_[i]] += comp_full_[i];
+		}
+	}
+
+	inline uint64_t SelfComp(RecordId _id) const {
+		return comp_self_[_id];
+	}
+
+	inline uint64_t FullComp(RecordId _id) const {
+		return comp_full_[_id];
+	}
+
+	uint64_t ColumnTotal(RecordColumn _column) const {
+		uint64_t total = 0;
+		const uint64_t *column = values_.Column(_column);
+		if (!column) {
+			return 0;
+		}
+
+		for (size_t i = 0; i < values_.Count(); ++i) {
+			total += column[i];
+		}
+		return total;
+	}
+
+	void Data2Json(FILE *fp, double total_elapse, RecordId _id) {
+		uint64_t call_count = CallCount(_id);
+		uint64_t full_elapse = FullElapse(_id);
+		uint64_t inner_elapse = InnerElapse(_id);
+		double full_per = full_elapse / total_elapse * 100;
+		double self_per = inner_elapse / total_elapse * 100;
+
+		const FunctionInfo *func_info = At(_id)->func_info_;
+		uint64_t full_ns = TicksToNs(full_elapse);
+		uint64_t inner_ns = TicksToNs(inner_elapse);
+		if (func_info) {
+			fprintf(fp, "'call':'%s:%s:%d','count':%lu,'total':%lu,'totalPercent':%.3lf,'self':%lu,'selfPercent':%.3lf",
+				func_info->name_.c_str(), func_info->source_.c_str(), func_info->linedefined_, call_count, full_ns, full_per, inner_ns, self_per);
+
+			if (compensated_) {
+				fprintf(fp, ",'selfComp':%lu,'totalComp':%lu",
+					TicksToNs(SelfComp(_id)), TicksToNs(FullComp(_id)));
+			}
+
+			uint64_t contaminated = Value(kRecordContaminatedElapse, _id);
+			if (contaminated != 0) {
+				fprintf(fp, ",'contaminated':%lu", TicksToNs(contaminated));
+			}
+
+			if (Value(kRecordAllocCount, _id) != 0 || Value(kRecordFreeBytes, _id) != 0) {
+				fprintf(fp, ",'allocCount':%lu,'allocBytes':%lu,'freeBytes':%lu,'allocTable':%lu,'allocString':%lu,'allocFunction':%lu,'allocUserdata':%lu,'allocOther':%lu",
+					Value(kRecordAllocCount, _id), Value(kRecordAllocBytes, _id), Value(kRecordFreeBytes, _id),
+					Value(kRecordAllocTable, _id), Value(kRecordAllocString, _id), Value(kRecordAllocFunction, _id),
+					Value(kRecordAllocUserdata, _id), Value(kRecordAllocOther, _id));
+			}
+
+			// phase times are not snapshotted, a window has none
+			const GcPhaseElapse *phases = window_ ? NULL : gc_phases_.Find(At(_id));
+			if (phases) {
+				fprintf(fp, ",'gcPropagate':%lu,'gcAtomic':%lu,'gcSweep':%lu,'gcCallfin':%lu",
+					TicksToNs(phases->elapse_[0]), TicksToNs(phases->elapse_[1]),
+					TicksToNs(phases->elapse_[2]), TicksToNs(phases->elapse_[3]));
+			}
+		} else {
+			uint64_t contaminated = ColumnTotal(kRecordContaminatedElapse);
+			fprintf(fp, "'call':'root','count':1,'total':%lu,'totalPercent':100,'self':0,'selfPercent':0", full_ns);
+			fprintf(fp, ",'contaminated':%lu,'contaminatedPercent':%.3lf,'migrations':%lu,'preemptions':%lu",
+				TicksToNs(contaminated), contaminated / total_elapse * 100,
+				ColumnTotal(kRecordMigrateCount), ColumnTotal(kRecordPreemptCount));
+
+			if (compensated_) {
+				fprintf(fp, ",'totalComp':%lu,'overheadParent':%.1lf,'overheadChild':%.1lf",
+					TicksToNs(FullComp(_id)),
+					ns_per_tick_ * overhead_parent_, ns_per_tick_ * overhead_child_);
+			}
+
+			uint64_t alloc_count = ColumnTotal(kRecordAllocCount);
+			if (alloc_count != 0) {
+				fprintf(fp, ",'allocCount':%lu,'allocBytes':%lu,'freeBytes':%lu,'allocTable':%lu,'allocString':%lu,'allocFunction':%lu,'allocUserdata':%lu,'allocOther':%lu",
+					alloc_count, ColumnTotal(kRecordAllocBytes), ColumnTotal(kRecordFreeBytes),
+					ColumnTotal(kRecordAllocTable), ColumnTotal(kRecordAllocString), ColumnTotal(kRecordAllocFunction),
+					ColumnTotal(kRecordAllocUserdata), ColumnTotal(kRecordAllocOther));
+			}
+		}
+
+		const RecordLink *link = Link(_id);
+		if (link->first_child_ != kNullRecordId) {
+			fprintf(fp, ",'subcall':[");
+			for (RecordId child = link->first_child_; child != kNullRecordId; child = Link(child)->next_sibling_) {
+				fprintf(fp, "{");
+				Data2Json(fp, total_elapse, child);
+				fprintf(fp, "},");
+			}
+			fprintf(fp, "]");
+		}
+	}
+
+private:
+	inline uint64_t TicksToNs(uint64_t _ticks) {
+		return (uint64_t)(_ticks * ns_per_tick_);
+	}
+
+	RecordId NewRecord(FunctionInfo *_info, RecordId _parent) {
+		const RecordBuffer::ElementPair& element = buffer_.Get();
+		RecordId id = records_.New(_info, (RecordId)element.first, element.second);
+		links_.New();
+		parents_.push_back(_parent);
+		assert(id == element.first);
+		return id;
+	}
+
+	RecordId AddChildRecord(Record *_parent, FunctionInfo *_info) {
+		RecordId id = NewRecord(_info, _parent->id_);
+
+		RecordLink *parent_link = Link(_parent->id_);
+		Link(id)->next_sibling_ = parent_link->first_child_;
+		parent_link->first_child_ = id;
+
+		if (!_parent->children_map_ && _parent->child_count_ < Record::kInlineChildCount) {
+			_parent->inline_children_[_parent->child_count_++] = id;
+			return id;
+		}
+
+		if (!_parent->children_map_) {
+			_parent->children_map_ = new Record::ChildrenMap(Record::kChildrenMapInitCount);
+			for (uint32_t i = 0; i < _parent->child_count_; ++i) {
+				RecordId child = _parent->inline_children_[i];
+				_parent->children_map_->Insert(records_.At(child)->func_info_, child);
+			}
+		}
+
+		_parent->children_map_->Insert(_info, id);
+		_parent->child_count_++;
+		return id;
+	}
+
+	void SortChildren(RecordId _id) {
+		RecordLink *link = Link(_id);
+		if (link->first_child_ == kNullRecordId || Link(link->first_child_)->next_sibling_ == kNullRecordId) {
+			return;
+		}
+
+		sort_buffer_.clear();
+		for (RecordId child = link->first_child_; child != kNullRecordId; child = Link(child)->next_sibling_) {
+			sort_buffer_.push_back(child);
+		}
+		sort(sort_buffer_.begin(), sort_buffer_.end(), RecordSort(&full_elapse_[0]));
+
+		link->first_child_ = sort_buffer_[0];
+		for (size_t i = 0; i + 1 < sort_buffer_.size(); ++i) {
+			Link(sort_buffer_[i])->next_sibling_ = sort_buffer_[i + 1];
+		}
+		Link(sort_buffer_.back())->next_sibling_ = kNullRecordId;
+	}
+
+private:
+	RecordBuffer buffer_;
+	RecordArena records_;
+	RecordLinkArena links_;
+	RecordIdList parents_;
+	RecordIdList sort_buffer_;
+	RecordCopy values_;
+	ElapseList full_elapse_;
+	ElapseList child_calls_;
+	ElapseList comp_self_;
+	ElapseList comp_full_;
+	RecordRing snapshots_;
+	RecordCopy start_copy_;
+	RecordCopy end_copy_;
+	GcPhaseMap gc_phases_;
+	bool window_;	// the last Aggregate was a snapshot window
+	double ns_per_tick_;
+	bool compensated_;
+	double overhead_parent_;
+	double overhead_child_;
+};
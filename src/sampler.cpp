@@ -0,0 +1,189 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "sampler.h"
+#include "clocks.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static Sampler *volatile g_active_sampler = NULL;
+
+void ShadowStack::Grow(int _count) {
+	int capacity = capacity_ > 0 ? capacity_ : kInitCapacity;
+	while (capacity < _count) {
+		capacity *= 2;
+	}
+
+	StackFrame *frames = new StackFrame[capacity];
+	memset(frames, 0, sizeof(StackFrame) * capacity);
+	if (frames_) {
+		memcpy(frames, frames_, sizeof(StackFrame) * capacity_);
+	}
+
+	StackFrame *old_frames = frames_;
+	std::atomic_signal_fence(std::memory_order_release);
+	frames_ = frames;
+	std::atomic_signal_fence(std::memory_order_release);
+	capacity_ = capacity;
+	delete[] old_frames;
+}
+
+// takes the frames running before we saw any call, never from the handler
+void ShadowStack::Seed(lua_State *L) {
+	int count = LuaCallDepth(L) + 1;
+	if (count > capacity_) {
+		Grow(count);
+	}
+
+	top_ = 0;
+	std::atomic_signal_fence(std::memory_order_release);
+	memset(frames_, 0, sizeof(StackFrame) * count);
+	LuaStackFrames(L, frames_, count);
+	std::atomic_signal_fence(std::memory_order_release);
+	top_ = count;
+}
+
+// leaf first, frames never seen are skipped
+int ShadowStack::Capture(StackFrame *_frames, int _max_count) const {
+	int top = top_;
+	std::atomic_signal_fence(std::memory_order_acquire);
+	const StackFrame *frames = frames_;
+	int count = 0;
+	for (int depth = top - 1; depth >= 0 && count < _max_count; --depth) {
+		if (frames[depth].func_) {
+			_frames[count++] = frames[depth];
+		}
+	}
+
+	return count;
+}
+
+Sampler::Sampler(void)
+	: main_L_(NULL)
+	, drain_hook_(NULL)
+	, lookup_(NULL)
+	, running_(false)
+	, timer_id_(0)
+	, last_time_(0)
+	, armed_L_(NULL)
+	, saved_hook_(NULL)
+	, saved_mask_(0)
+	, saved_count_(0)
+	, armed_(0)
+	, dropped_count_(0) {
+	memset(&old_action_, 0, sizeof(old_action_));
+}
+
+Sampler::~Sampler(void) {
+	Stop();
+}
+
+bool Sampler::Start(lua_State *L, int _hz, lua_Hook _drain_hook, ShadowLookup _lookup) {
+	if (running_ || g_active_sampler) {
+		return false;
+	}
+
+	main_L_ = L;
+	drain_hook_ = _drain_hook;
+	lookup_ = _lookup;
+	last_time_ = GetClockTime(CLOCK_THREAD_CPUTIME_ID);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = SignalHandler;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGPROF, &action, &old_action_) != 0) {
+		return false;
+	}
+
+	// cpu time of the thread running lua only
+	struct sigevent event;
+	memset(&event, 0, sizeof(event));
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGPROF;
+	event.sigev_notify_thread_id = syscall(SYS_gettid);
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer_id_) != 0) {
+		sigaction(SIGPROF, &old_action_, NULL);
+		return false;
+	}
+
+	g_active_sampler = this;
+	running_ = true;
+
+	struct itimerspec spec;
+	spec.it_interval.tv_sec = 0;
+	spec.it_interval.tv_nsec = 1000000000L / _hz;
+	spec.it_value = spec.it_interval;
+	if (timer_settime(timer_id_, 0, &spec, NULL) != 0) {
+		Stop();
+		return false;
+	}
+
+	return true;
+}
+
+void Sampler::Stop(void) {
+	if (!running_) {
+		return;
+	}
+
+	timer_delete(timer_id_);
+	sigaction(SIGPROF, &old_action_, NULL);
+	g_active_sampler = NULL;
+	running_ = false;
+	Disarm();
+}
+
+// gives the armed thread its own hook back, whether or not the drain hook
+// ever ran there. a signal landing before armed_ is cleared sees it set and
+// leaves the hook alone
+void Sampler::Disarm(void) {
+	if (!armed_) {
+		return;
+	}
+
+	if (lua_gethook(armed_L_) == drain_hook_) {
+		lua_sethook(armed_L_, saved_hook_, saved_mask_, saved_count_);
+	}
+	armed_ = 0;
+}
+
+void Sampler::SignalHandler(int _sig, siginfo_t *_info, void *_context) {
+	Sampler *sampler = g_active_sampler;
+	if (sampler) {
+		sampler->OnSignal();
+	}
+}
+
+void Sampler::OnSignal(void) {
+	// the timer counts thread cpu time, so the weight does too
+	uint64_t curr_time = GetClockTime(CLOCK_THREAD_CPUTIME_ID);
+	uint64_t weight = curr_time - last_time_;
+	last_time_ = curr_time;
+
+	lua_State *L = LuaRunningThread(main_L_);
+	Sample *sample = ring_.BeginWrite();
+	if (!sample) {
+		dropped_count_ = dropped_count_ + 1;
+		return;
+	}
+
+	const ShadowStack *shadow = lookup_(L);
+	sample->weight_ = weight;
+	sample->depth_ = shadow ? shadow->Capture(sample->frames_, kMaxSampleDepth) : 0;
+	ring_.EndWrite();
+
+	// fold samples into the tree from a safe point before the ring fills up
+	if (!armed_ && ring_.Size() >= kRingSize / 2) {
+		armed_L_ = L;
+		saved_hook_ = lua_gethook(L);
+		saved_mask_ = lua_gethookmask(L);
+		saved_count_ = lua_gethookcount(L);
+		armed_ = 1;
+		lua_sethook(L, drain_hook_, LUA_MASKCOUNT, 1);
+	}
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <atomic>
+
+#include "lua_internal.h"
+
+static const int kMaxSampleDepth = 64;
+
+struct Sample {
+	uint64_t weight_;	// thread cpu ns since the previous signal, the clock the timer runs on
+	int depth_;
+	StackFrame frames_[kMaxSampleDepth];	// leaf first
+};
+
+// frames of one thread indexed by depth, written by the profcall callback so
+// the signal handler never walks the VM's CallInfo list. every store is
+// published with a signal fence and a replaced frame array is freed only
+// once the new one is visible, so the handler sees a consistent prefix.
+// after a longjmp the top stays stale until the next call or return
+class ShadowStack {
+	static const int kInitCapacity = 32;
+public:
+	ShadowStack(void) : frames_(NULL), capacity_(0), top_(0) {}
+
+	~ShadowStack(void) {
+		delete[] frames_;
+	}
+
+	// a tail call comes with the depth of the frame it replaces
+	inline void Call(int _depth, const void *_func, const void *_proto) {
+		if (_depth >= capacity_) {
+			Grow(_depth + 1);
+		}
+
+		StackFrame *frame = &frames_[_depth];
+		frame->func_ = _func;
+		frame->proto_ = _proto;
+		std::atomic_signal_fence(std::memory_order_release);
+		top_ = _depth + 1;
+	}
+
+	inline void Return(int _depth) {
+		top_ = _depth;
+	}
+
+	void Seed(lua_State *L);
+	int Capture(StackFrame *_frames, int _max_count) const;
+
+private:
+	void Grow(int _count);
+
+private:
+	StackFrame *volatile frames_;
+	int capacity_;
+	volatile int top_;
+};
+
+// the shadow stack of a thread, called from the signal handler
+typedef ShadowStack *(*ShadowLookup)(lua_State *L);
+
+// single producer (signal handler) / single consumer (lua thread) ring
+template <size_t N>
+class SampleRing {
+	static_assert((N & (N - 1)) == 0, "SampleRing size must be power of 2");
+public:
+	SampleRing(void) : head_(0), tail_(0) {}
+
+	inline Sample *BeginWrite(void) {
+		uint32_t head = head_.load(std::memory_order_relaxed);
+		if (head - tail_.load(std::memory_order_acquire) >= N) {
+			return NULL;
+		}
+
+		return &samples_[head & (N - 1)];
+	}
+
+	inline void EndWrite(void) {
+		head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	inline Sample *Front(void) {
+		uint32_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail == head_.load(std::memory_order_acquire)) {
+			return NULL;
+		}
+
+		return &samples_[tail & (N - 1)];
+	}
+
+	inline void Pop(void) {
+		tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	inline size_t Size(void) {
+		return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+	}
+
+private:
+	std::atomic<uint32_t> head_;
+	std::atomic<uint32_t> tail_;
+	Sample samples_[N];
+};
+
+class Sampler {
+	static const size_t kRingSize = 256;
+public:
+	typedef SampleRing<kRingSize> Ring;
+
+	Sampler(void);
+	~Sampler(void);
+
+	bool Start(lua_State *L, int _hz, lua_Hook _drain_hook, ShadowLookup _lookup);
+	void Stop(void);
+
+	inline Sample *Front(void) {
+		return ring_.Front();
+	}
+
+	inline void Pop(void) {
+		ring_.Pop();
+	}
+
+	void Disarm(void);
+
+	// _L is being freed, it must not be touched by Disarm
+	inline void Forget(lua_State *L) {
+		if (armed_ && armed_L_ == L) {
+			armed_ = 0;
+		}
+	}
+
+	inline uint64_t DroppedCount(void) {
+		return dropped_count_;
+	}
+
+private:
+	static void SignalHandler(int _sig, siginfo_t *_info, void *_context);
+	void OnSignal(void);
+
+private:
+	lua_State *main_L_;
+	lua_Hook drain_hook_;
+	ShadowLookup lookup_;
+	bool running_;
+	timer_t timer_id_;
+	struct sigaction old_action_;
+	uint64_t last_time_;
+	lua_State *armed_L_;	// thread carrying the drain hook, with the hook it had before
+	lua_Hook saved_hook_;
+	int saved_mask_;
+	int saved_count_;
+	volatile sig_atomic_t armed_;
+	volatile uint64_t dropped_count_;
+	Ring ring_;
+};
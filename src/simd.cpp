@@ -0,0 +1,70 @@
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#endif
+
+typedef void (*DiffColumnFunc)(uint64_t *, const uint64_t *, const uint64_t *, size_t);
+
+static void DiffColumnScalar(uint64_t *_out, const uint64_t *_end, const uint64_t *_start, size_t _count) {
+	for (size_t i = 0; i < _count; ++i) {
+		_out[i] = _end[i] - _start[i];
+	}
+}
+
+#ifdef SIMD_X86
+static void DiffColumnSse2(uint64_t *_out, const uint64_t *_end, const uint64_t *_start, size_t _count) {
+	size_t i = 0;
+	for (; i + 4 <= _count; i += 4) {
+		__m128i e0 = _mm_loadu_si128((const __m128i *)(_end + i));
+		__m128i e1 = _mm_loadu_si128((const __m128i *)(_end + i + 2));
+		__m128i s0 = _mm_loadu_si128((const __m128i *)(_start + i));
+		__m128i s1 = _mm_loadu_si128((const __m128i *)(_start + i + 2));
+		_mm_storeu_si128((__m128i *)(_out + i), _mm_sub_epi64(e0, s0));
+		_mm_storeu_si128((__m128i *)(_out + i + 2), _mm_sub_epi64(e1, s1));
+	}
+	DiffColumnScalar(_out + i, _end + i, _start + i, _count - i);
+}
+
+__attribute__((target("avx2")))
+static void DiffColumnAvx2(uint64_t *_out, const uint64_t *_end, const uint64_t *_start, size_t _count) {
+	size_t i = 0;
+	for (; i + 8 <= _count; i += 8) {
+		__m256i e0 = _mm256_loadu_si256((const __m256i *)(_end + i));
+		__m256i e1 = _mm256_loadu_si256((const __m256i *)(_end + i + 4));
+		__m256i s0 = _mm256_loadu_si256((const __m256i *)(_start + i));
+		__m256i s1 = _mm256_loadu_si256((const __m256i *)(_start + i + 4));
+		_mm256_storeu_si256((__m256i *)(_out + i), _mm256_sub_epi64(e0, s0));
+		_mm256_storeu_si256((__m256i *)(_out + i + 4), _mm256_sub_epi64(e1, s1));
+	}
+	DiffColumnScalar(_out + i, _end + i, _start + i, _count - i);
+}
+#endif
+
+static const char *g_diff_column_isa = "scalar";
+
+static DiffColumnFunc SelectDiffColumn(void) {
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		g_diff_column_isa = "avx2";
+		return DiffColumnAvx2;
+	}
+
+	g_diff_column_isa = "sse2";
+	return DiffColumnSse2;
+#else
+	return DiffColumnScalar;
+#endif
+}
+
+static const DiffColumnFunc kDiffColumn = SelectDiffColumn();
+
+void DiffColumn(uint64_t *_out, const uint64_t *_end, const uint64_t *_start, size_t _count) {
+	kDiffColumn(_out, _end, _start, _count);
+}
+
+const char *DiffColumnIsa(void) {
+	return g_diff_column_isa;
+}
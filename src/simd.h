@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// _out[i] = _end[i] - _start[i], AVX2 or SSE2 picked at load time
+void DiffColumn(uint64_t *_out, const uint64_t *_end, const uint64_t *_start, size_t _count);
+const char *DiffColumnIsa(void);
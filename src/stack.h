@@ -1,8 +1,16 @@
 #pragma once
 
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
 #include <vector>
-#include <list>
+#include <deque>
+#include <string>
+#include <algorithm>
+
+#include "simd.h"
 
 using namespace std;
 
@@ -84,123 +92,707 @@ private:
 	vector<char> buffer_;
 };
 
-template <typename T>
-class StaticBuffer {
+// bit c set when column c is kept, columns outside the mask take no memory and read as zero
+static inline size_t ColumnMaskCount(const uint32_t _mask) {
+	return (size_t)__builtin_popcount(_mask);
+}
+
+// flat copy of the columns of a ColumnBuffer, one aligned array per kept column
+template <size_t N>
+class ColumnSnapshot {
+	static const size_t kAlignment = 64;
+	static_assert(N <= 32, "column masks hold 32 columns");
 public:
-	StaticBuffer(const size_t _max_count) 
-		: max_count_(_max_count)
-		, element_size_(sizeof(T))
-		, curr_count_(0)
-		, buffer_(max_count_ * element_size_) {}
+	static const uint32_t kAllColumns = (uint32_t)((1ULL << N) - 1);
+
+	ColumnSnapshot(const size_t _count = 0, const uint32_t _mask = kAllColumns)
+		: count_(0)
+		, capacity_(0)
+		, mask_(_mask) {
+		for (size_t i = 0; i < N; ++i) {
+			columns_[i] = NULL;
+		}
+		Resize(_count);
+	}
 
-	inline void Put(const char *buffer, const size_t size) {
-		size_t curr_capacity = curr_count_ * element_size_;
-		assert(curr_capacity + size <= buffer_.size());
+	~ColumnSnapshot(void) {
+		for (size_t i = 0; i < N; ++i) {
+			free(columns_[i]);
+			columns_[i] = NULL;
+		}
+	}
+
+	// drops the arrays when the kept columns change
+	void SetMask(const uint32_t _mask) {
+		if (_mask == mask_) {
+			return;
+		}
 
-		bcopy(buffer, &buffer_[curr_capacity], size);
-		curr_count_ += size / element_size_;
+		for (size_t i = 0; i < N; ++i) {
+			free(columns_[i]);
+			columns_[i] = NULL;
+		}
+		count_ = 0;
+		capacity_ = 0;
+		mask_ = _mask;
 	}
 
-	inline const T *operator[](const size_t _pos) const {
-		assert(_pos < curr_count_);
-		return reinterpret_cast<const T*>(&buffer_[_pos * element_size_]);
+	inline uint32_t Mask(void) const {
+		return mask_;
 	}
 
-	inline const T *At(const size_t _pos) const {
-		if (_pos >= curr_count_) {
-			return NULL;
+	inline bool Has(const size_t _column) const {
+		return (mask_ >> _column) & 1;
+	}
+
+	// keeps the arrays when shrinking, contents are undefined after growing
+	void Resize(const size_t _count) {
+		Reserve(_count, false);
+		count_ = _count;
+	}
+
+	// grows keeping the contents, new rows start at zero
+	void Extend(const size_t _count) {
+		if (_count <= count_) {
+			return;
 		}
 
-		return reinterpret_cast<const T*>(&buffer_[_pos * element_size_]);
+		Reserve(_count, true);
+		for (size_t i = 0; i < N; ++i) {
+			if (Has(i)) {
+				memset(columns_[i] + count_, 0, (_count - count_) * sizeof(uint64_t));
+			}
+		}
+		count_ = _count;
+	}
+
+	void Copy(const ColumnSnapshot *_other) {
+		SetMask(_other->mask_);
+		Resize(_other->count_);
+		for (size_t i = 0; i < N; ++i) {
+			if (Has(i)) {
+				memcpy(columns_[i], _other->columns_[i], count_ * sizeof(uint64_t));
+			}
+		}
+	}
+
+	void Swap(ColumnSnapshot &_other) {
+		swap(count_, _other.count_);
+		swap(capacity_, _other.capacity_);
+		swap(mask_, _other.mask_);
+		for (size_t i = 0; i < N; ++i) {
+			swap(columns_[i], _other.columns_[i]);
+		}
+	}
+
+	inline size_t Count(void) const {
+		return count_;
+	}
+
+	// NULL for a column outside the mask
+	inline uint64_t *Column(const size_t _column) {
+		return columns_[_column];
+	}
+
+	inline const uint64_t *Column(const size_t _column) const {
+		return columns_[_column];
+	}
+
+	inline uint64_t Get(const size_t _column, const size_t _pos) const {
+		return _pos < count_ && Has(_column) ? columns_[_column][_pos] : 0;
+	}
+
+	// this = _end - _start, rows missing from _start count as zero, both keep the same columns
+	void Diff(const ColumnSnapshot *_start, const ColumnSnapshot *_end) {
+		assert(!_start || _start->mask_ == _end->mask_);
+		SetMask(_end->mask_);
+		Resize(_end->count_);
+		size_t common = _start ? min(_start->count_, _end->count_) : 0;
+		for (size_t c = 0; c < N; ++c) {
+			if (!Has(c)) {
+				continue;
+			}
+
+			uint64_t *out = columns_[c];
+			const uint64_t *end = _end->columns_[c];
+			if (common > 0) {
+				DiffColumn(out, end, _start->columns_[c], common);
+			}
+			memcpy(out + common, end + common, (count_ - common) * sizeof(uint64_t));
+		}
 	}
 
 private:
-	size_t max_count_;
-	size_t element_size_;
-	size_t curr_count_;
-	vector<char> buffer_;
+	void Reserve(const size_t _count, const bool _keep) {
+		if (_count <= capacity_) {
+			return;
+		}
+
+		size_t capacity = capacity_ ? capacity_ : 64;
+		while (capacity < _count) {
+			capacity *= 2;
+		}
+
+		for (size_t i = 0; i < N; ++i) {
+			if (!Has(i)) {
+				continue;
+			}
+
+			void *column = NULL;
+			if (posix_memalign(&column, kAlignment, capacity * sizeof(uint64_t)) != 0) {
+				abort();
+			}
+			if (_keep && columns_[i]) {
+				memcpy(column, columns_[i], count_ * sizeof(uint64_t));
+			}
+			free(columns_[i]);
+			columns_[i] = (uint64_t *)column;
+		}
+		capacity_ = capacity;
+	}
+
+private:
+	size_t count_;
+	size_t capacity_;
+	uint32_t mask_;
+	uint64_t *columns_[N];
 };
 
-template <typename T>
-class MultiStackBuffer {
-	static const size_t kPerAddCount = 1024;
-	typedef list<StackBuffer<T> *> StackBufferList;
-	typedef vector<StaticBuffer<T> *> StaticBufferVector;
+// rows of up to N uint64_t counters kept column by column inside aligned chunks,
+// only the columns in the mask get space. a row is addressed by its first kept
+// column and every kept column lives Offset(c) after it
+template <size_t N>
+class ColumnBuffer {
+	static const size_t kAlignment = 64;
 public:
-	typedef pair<size_t, T*> ElementPair;
+	static const size_t kChunkShift = 12;
+	static const size_t kChunkRows = 1 << kChunkShift;
+	static const size_t kChunkMask = kChunkRows - 1;
+
+	typedef ColumnSnapshot<N> Snapshot;
+	typedef vector<uint64_t *> ChunkVector;
+	typedef pair<size_t, uint64_t *> ElementPair;
+
+	ColumnBuffer(const uint32_t _mask = Snapshot::kAllColumns)
+		: curr_count_(0)
+		, mask_(_mask)
+		, width_(ColumnMaskCount(_mask)) {
+		size_t slot = 0;
+		for (size_t c = 0; c < N; ++c) {
+			offsets_[c] = slot * kChunkRows;
+			slot += (_mask >> c) & 1;
+		}
+	}
 
-	MultiStackBuffer(const size_t _per_add_count = kPerAddCount) 
-		: per_add_count_(_per_add_count)
-		, curr_count_(0)
-		, curr_stack_(NULL) {
-		assert(per_add_count_ != 0);
-		Resize();
+	~ColumnBuffer(void) {
+		for (typename ChunkVector::const_iterator citr = chunks_.begin();
+			citr != chunks_.end(); ++citr) {
+			free(*citr);
+		}
+		chunks_.clear();
+	}
+
+	inline ElementPair Get(void) {
+		if ((curr_count_ >> kChunkShift) >= chunks_.size()) {
+			void *chunk = NULL;
+			if (posix_memalign(&chunk, kAlignment, width_ * kChunkRows * sizeof(uint64_t)) != 0) {
+				abort();
+			}
+			memset(chunk, 0, width_ * kChunkRows * sizeof(uint64_t));
+			chunks_.push_back((uint64_t *)chunk);
+		}
+
+		size_t index = curr_count_++;
+		return ElementPair(index, Row(index));
+	}
+
+	inline uint64_t *Row(const size_t _index) {
+		return &chunks_[_index >> kChunkShift][_index & kChunkMask];
+	}
+
+	inline size_t Size(void) const {
+		return curr_count_;
+	}
+
+	inline bool Has(const size_t _column) const {
+		return (mask_ >> _column) & 1;
+	}
+
+	// from the row pointer to _column of the same row, _column must be kept
+	inline size_t Offset(const size_t _column) const {
+		assert(Has(_column));
+		return offsets_[_column];
 	}
 
-	~MultiStackBuffer(void) {
-		for (typename StackBufferList::const_iterator citr = stack_buffer_list_.begin();
-			citr != stack_buffer_list_.end(); ++citr) {
-			StackBuffer<T> *stack_buffer = *citr;
-			delete stack_buffer;
+	void Zero(void) {
+		for (size_t i = 0; i * kChunkRows < curr_count_; ++i) {
+			memset(chunks_[i], 0, width_ * kChunkRows * sizeof(uint64_t));
 		}
-		stack_buffer_list_.clear();
+	}
+
+	void Capture(Snapshot *_snapshot) {
+		_snapshot->SetMask(mask_);
+		_snapshot->Resize(curr_count_);
+		for (size_t c = 0; c < N; ++c) {
+			if (!Has(c)) {
+				continue;
+			}
 
-		for (typename StaticBufferVector::const_iterator citr = records_.begin();
-			citr != records_.end(); ++citr) {
-			StaticBuffer<T> *static_buffer = *citr;
-			delete static_buffer;
+			uint64_t *column = _snapshot->Column(c);
+			for (size_t i = 0; i * kChunkRows < curr_count_; ++i) {
+				size_t rows = min(kChunkRows, curr_count_ - i * kChunkRows);
+				memcpy(column + i * kChunkRows, chunks_[i] + offsets_[c], rows * sizeof(uint64_t));
+			}
 		}
-		records_.clear();
 	}
 
-	template <typename ... TArgs>
-	inline ElementPair Get(TArgs ... _args) {
-		if (curr_stack_->IsFull()) {
-			Resize();
+private:
+	size_t curr_count_;
+	uint32_t mask_;
+	size_t width_;
+	size_t offsets_[N];
+	ChunkVector chunks_;
+};
+
+static inline void PutVarint(vector<uint8_t> *_out, uint64_t _value) {
+	while (_value >= 0x80) {
+		_out->push_back((uint8_t)(_value | 0x80));
+		_value >>= 7;
+	}
+	_out->push_back((uint8_t)_value);
+}
+
+static inline uint64_t GetVarint(const uint8_t *&_pos) {
+	uint64_t value = 0;
+	int shift = 0;
+	while (*_pos & 0x80) {
+		value |= (uint64_t)(*_pos++ & 0x7f) << shift;
+		shift += 7;
+	}
+	value |= (uint64_t)(*_pos++) << shift;
+	return value;
+}
+
+// bounded history of ColumnSnapshots: the last keep_count_ entries plus every
+// stride_-th older one, at most capacity_ in total, oldest dropped first.
+// sequence numbers stay stable while entries come and go.
+// an entry is either a full keyframe or the rows changed since the previous
+// retained entry, as varints: the row count, then per changed row the gap
+// from the previous changed row and the deltas of the columns in the mask
+template <size_t N>
+class SnapshotRing {
+	static const size_t kMaxFreeCount = 2;
+public:
+	typedef ColumnSnapshot<N> Snapshot;
+	typedef vector<uint8_t> DeltaBuffer;
+
+	struct Entry {
+		uint64_t seq_;
+		uint64_t time_;
+		string label_;
+		Snapshot *keyframe_;
+		DeltaBuffer delta_;
+	};
+
+	typedef deque<Entry> EntryDeque;
+	typedef vector<Snapshot *> SnapshotVector;
+
+	SnapshotRing(const size_t _keep_count, const size_t _stride, const size_t _capacity, const size_t _keyframe_interval,
+		const uint32_t _mask)
+		: width_(0)
+		, keep_count_(_keep_count)
+		, stride_(_stride)
+		, capacity_(max(_capacity, _keep_count))
+		, keyframe_interval_(_keyframe_interval)
+		, since_keyframe_(0)
+		, next_seq_(0) {
+		assert(keep_count_ != 0);
+		assert(keyframe_interval_ != 0);
+		for (size_t c = 0; c < N; ++c) {
+			if ((_mask >> c) & 1) {
+				columns_[width_++] = c;
+			}
+		}
+	}
+
+	~SnapshotRing(void) {
+		for (typename EntryDeque::const_iterator citr = entries_.begin();
+			citr != entries_.end(); ++citr) {
+			delete citr->keyframe_;
 		}
+		entries_.clear();
 
-		T *element = curr_stack_->Get(_args...);
-		return ElementPair(curr_count_++, element);
+		for (typename SnapshotVector::const_iterator citr = free_list_.begin();
+			citr != free_list_.end(); ++citr) {
+			delete *citr;
+		}
+		free_list_.clear();
 	}
 
-	void Save(void) {
-		StaticBuffer<T> *static_buffer = new StaticBuffer<T>(curr_count_);
+	// filled by the caller before Push
+	inline Snapshot *Current(void) {
+		return &current_;
+	}
 
-		for (typename StackBufferList::const_iterator citr = stack_buffer_list_.begin();
-			citr != stack_buffer_list_.end(); ++citr) {
-			StackBuffer<T> *stack_buffer = *citr;
-			if (stack_buffer->BufferSize() > 0) {
-				static_buffer->Put(stack_buffer->Buffer(), stack_buffer->BufferSize());
+	uint64_t Push(const uint64_t _time, const char *_label) {
+		entries_.push_back(Entry());
+		Entry &entry = entries_.back();
+		entry.seq_ = next_seq_++;
+		entry.time_ = _time;
+		entry.label_ = _label ? _label : "";
+		entry.keyframe_ = NULL;
+
+		if (entries_.size() == 1 || since_keyframe_ + 1 >= keyframe_interval_
+			|| !EncodeDelta(&last_, &current_, &entry.delta_)) {
+			entry.delta_.clear();
+			entry.keyframe_ = Acquire();
+			entry.keyframe_->Copy(&current_);
+			since_keyframe_ = 0;
+		} else {
+			since_keyframe_++;
+		}
+		last_.Swap(current_);
+		uint64_t seq = entry.seq_;
+
+		// the entry just leaving the recent window survives on stride positions only
+		if (entries_.size() > keep_count_) {
+			size_t pos = entries_.size() - keep_count_ - 1;
+			if (stride_ == 0 || entries_[pos].seq_ % stride_ != 0) {
+				Evict(pos);
 			}
 		}
 
-		records_.push_back(static_buffer);
+		while (entries_.size() > capacity_) {
+			Evict(0);
+		}
+
+		return seq;
 	}
 
-	inline size_t GetRecordCount(void) {
-		return records_.size();
+	// sequence numbers keep counting
+	void Clear(void) {
+		for (typename EntryDeque::const_iterator citr = entries_.begin();
+			citr != entries_.end(); ++citr) {
+			if (citr->keyframe_) {
+				Release(citr->keyframe_);
+			}
+		}
+		entries_.clear();
+		last_.Resize(0);
+		since_keyframe_ = 0;
 	}
 
-	inline const StaticBuffer<T> *GetRecordByIndex(size_t _index) {
-		if (_index < records_.size()) {
-			return records_[_index];
+	const Entry *Find(const uint64_t _seq) const {
+		size_t pos = Position(_seq);
+		return pos < entries_.size() ? &entries_[pos] : NULL;
+	}
+
+	// rebuilds the snapshot from the closest keyframe, _scratch may be used as storage
+	const Snapshot *Load(const uint64_t _seq, Snapshot *_scratch) const {
+		size_t pos = Position(_seq);
+		if (pos >= entries_.size()) {
+			return NULL;
 		}
 
-		return NULL;
+		if (pos + 1 == entries_.size()) {
+			return &last_;
+		}
+
+		if (entries_[pos].keyframe_) {
+			return entries_[pos].keyframe_;
+		}
+
+		size_t base = pos;
+		while (!entries_[base].keyframe_) {
+			--base;
+		}
+
+		_scratch->Copy(entries_[base].keyframe_);
+		for (size_t i = base + 1; i <= pos; ++i) {
+			ApplyDelta(_scratch, entries_[i].delta_);
+		}
+
+		return _scratch;
+	}
+
+	inline size_t Size(void) const {
+		return entries_.size();
+	}
+
+	inline const Entry &At(const size_t _pos) const {
+		return entries_[_pos];
 	}
 
 private:
-	inline void Resize(void) {
-		curr_stack_ = new StackBuffer<T>(per_add_count_);
-		stack_buffer_list_.push_back(curr_stack_);
+	struct DeltaReader {
+		const uint8_t *pos_;
+		const uint8_t *end_;
+		size_t count_;
+		size_t next_;
+		size_t row_;
+		uint64_t values_[N];	// by slot in the kept columns
+		size_t width_;
+		bool valid_;
+
+		DeltaReader(const DeltaBuffer &_delta, const size_t _width)
+			: pos_(&_delta[0])
+			, end_(&_delta[0] + _delta.size())
+			, count_(0)
+			, next_(0)
+			, row_(0)
+			, width_(_width)
+			, valid_(false) {
+			count_ = GetVarint(pos_);
+			Next();
+		}
+
+		void Next(void) {
+			valid_ = pos_ < end_;
+			if (!valid_) {
+				return;
+			}
+
+			row_ = next_ + GetVarint(pos_);
+			for (size_t k = 0; k < width_; ++k) {
+				values_[k] = GetVarint(pos_);
+			}
+			next_ = row_ + 1;
+		}
+	};
+
+	// fails when a counter went backwards or the delta is not worth it
+	bool EncodeDelta(const Snapshot *_prev, const Snapshot *_curr, DeltaBuffer *_out) const {
+		if (_curr->Count() < _prev->Count()) {
+			return false;
+		}
+
+		_out->clear();
+		PutVarint(_out, _curr->Count());
+
+		size_t limit = _curr->Count() * width_ * sizeof(uint64_t) / 2;
+		// rows past the previous count read as zero, so its columns are never touched there
+		const uint64_t *prev_columns[N];
+		const uint64_t *curr_columns[N];
+		for (size_t k = 0; k < width_; ++k) {
+			prev_columns[k] = _prev->Column(columns_[k]);
+			curr_columns[k] = _curr->Column(columns_[k]);
+		}
+
+		size_t prev_count = _prev->Count();
+		size_t next = 0;
+		uint64_t values[N];
+		for (size_t row = 0; row < _curr->Count(); ++row) {
+			bool changed = false;
+			for (size_t k = 0; k < width_; ++k) {
+				uint64_t prev = row < prev_count ? prev_columns[k][row] : 0;
+				uint64_t curr = curr_columns[k][row];
+				if (curr < prev) {
+					return false;
+				}
+				values[k] = curr - prev;
+				changed |= values[k] != 0;
+			}
+
+			if (!changed) {
+				continue;
+			}
+
+			PutDeltaRow(_out, row - next, values);
+			next = row + 1;
+
+			if (_out->size() > limit) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	inline void PutDeltaRow(DeltaBuffer *_out, const size_t _gap, const uint64_t *_values) const {
+		PutVarint(_out, _gap);
+		for (size_t k = 0; k < width_; ++k) {
+			PutVarint(_out, _values[k]);
+		}
+	}
+
+	void ApplyDelta(Snapshot *_target, const DeltaBuffer &_delta) const {
+		DeltaReader reader(_delta, width_);
+		_target->Extend(reader.count_);
+		for (; reader.valid_; reader.Next()) {
+			for (size_t k = 0; k < width_; ++k) {
+				_target->Column(columns_[k])[reader.row_] += reader.values_[k];
+			}
+		}
+	}
+
+	// deltas add up, _first then _second as one delta
+	void MergeDelta(const DeltaBuffer &_first, const DeltaBuffer &_second, DeltaBuffer *_out) const {
+		DeltaReader first(_first, width_);
+		DeltaReader second(_second, width_);
+
+		_out->clear();
+		PutVarint(_out, max(first.count_, second.count_));
+
+		size_t next = 0;
+		uint64_t values[N];
+		while (first.valid_ || second.valid_) {
+			size_t row = 0;
+			if (!second.valid_ || (first.valid_ && first.row_ < second.row_)) {
+				row = first.row_;
+				memcpy(values, first.values_, sizeof(values));
+				first.Next();
+			} else if (!first.valid_ || second.row_ < first.row_) {
+				row = second.row_;
+				memcpy(values, second.values_, sizeof(values));
+				second.Next();
+			} else {
+				row = first.row_;
+				for (size_t k = 0; k < width_; ++k) {
+					values[k] = first.values_[k] + second.values_[k];
+				}
+				first.Next();
+				second.Next();
+			}
+
+			PutDeltaRow(_out, row - next, values);
+			next = row + 1;
+		}
+	}
+
+	// the successor takes over what it was based on
+	void Evict(const size_t _pos) {
+		Entry &entry = entries_[_pos];
+		if (_pos + 1 < entries_.size()) {
+			Entry &next = entries_[_pos + 1];
+			if (!next.keyframe_) {
+				if (entry.keyframe_) {
+					ApplyDelta(entry.keyframe_, next.delta_);
+					next.keyframe_ = entry.keyframe_;
+					entry.keyframe_ = NULL;
+					DeltaBuffer().swap(next.delta_);
+				} else {
+					MergeDelta(entry.delta_, next.delta_, &merge_buffer_);
+					next.delta_.swap(merge_buffer_);
+				}
+			}
+		}
+
+		if (entry.keyframe_) {
+			Release(entry.keyframe_);
+		}
+		entries_.erase(entries_.begin() + _pos);
+	}
+
+	size_t Position(const uint64_t _seq) const {
+		size_t low = 0;
+		size_t high = entries_.size();
+		while (low < high) {
+			size_t mid = (low + high) / 2;
+			if (entries_[mid].seq_ < _seq) {
+				low = mid + 1;
+			} else {
+				high = mid;
+			}
+		}
+
+		if (low < entries_.size() && entries_[low].seq_ == _seq) {
+			return low;
+		}
+
+		return entries_.size();
+	}
+
+	Snapshot *Acquire(void) {
+		if (free_list_.empty()) {
+			return new Snapshot();
+		}
+
+		Snapshot *snapshot = free_list_.back();
+		free_list_.pop_back();
+		return snapshot;
+	}
+
+	void Release(Snapshot *_snapshot) {
+		if (free_list_.size() < kMaxFreeCount) {
+			free_list_.push_back(_snapshot);
+		} else {
+			delete _snapshot;
+		}
 	}
 
 private:
-	size_t per_add_count_;
-	size_t curr_count_;
+	size_t columns_[N];	// ids of the kept columns
+	size_t width_;
+	size_t keep_count_;
+	size_t stride_;
+	size_t capacity_;
+	size_t keyframe_interval_;
+	size_t since_keyframe_;
+	uint64_t next_seq_;
+	EntryDeque entries_;
+	SnapshotVector free_list_;
+	Snapshot current_;
+	Snapshot last_;
+	DeltaBuffer merge_buffer_;
+};
 
-	StackBuffer<T> *curr_stack_;
-	StackBufferList stack_buffer_list_;
+// fixed size chunks addressed by 32-bit index, elements never move
+template <typename T>
+class ChunkArena {
+	static const size_t kChunkShift = 12;
+	static const size_t kChunkCount = 1 << kChunkShift;
+	static const size_t kChunkMask = kChunkCount - 1;
+	static const size_t kAlignment = 64;
+	typedef vector<T *> ChunkVector;
+public:
+	ChunkArena(void) : curr_count_(0) {}
+
+	~ChunkArena(void) {
+		Clear();
+		for (typename ChunkVector::const_iterator citr = chunks_.begin();
+			citr != chunks_.end(); ++citr) {
+			free(*citr);
+		}
+		chunks_.clear();
+	}
+
+	template <typename ... TArgs>
+	inline uint32_t New(TArgs ... _args) {
+		if ((curr_count_ >> kChunkShift) >= chunks_.size()) {
+			void *chunk = NULL;
+			if (posix_memalign(&chunk, kAlignment, kChunkCount * sizeof(T)) != 0) {
+				abort();
+			}
+			chunks_.push_back((T *)chunk);
+		}
+
+		uint32_t index = (uint32_t)curr_count_++;
+		new (At(index)) T(_args...);
+		return index;
+	}
+
+	inline T *At(const uint32_t _index) {
+		return &chunks_[_index >> kChunkShift][_index & kChunkMask];
+	}
+
+	inline T *operator[](const uint32_t _index) {
+		assert(_index < curr_count_);
+		return At(_index);
+	}
+
+	inline size_t Size(void) const {
+		return curr_count_;
+	}
+
+	// keeps the chunks for reuse
+	void Clear(void) {
+		for (size_t i = 0; i < curr_count_; ++i) {
+			At((uint32_t)i)->~T();
+		}
+		curr_count_ = 0;
+	}
 
-	StaticBufferVector records_;
-};
\ No newline at end of file
+private:
+	size_t curr_count_;
+	ChunkVector chunks_;
+};
@@ -0,0 +1,58 @@
+-- allocation columns count every table made, and sampled tags stay live only
+-- for the site whose blocks are still reachable, until they are freed.
+-- exits non zero on failure
+-- usage: LUA_CPATH="luaclib/?.so" lua test/alloc_tags.lua [out_dir]
+local profiler = require "profiler.c"
+
+local out_dir = arg[1] or "/tmp"
+local n = 20000
+
+local kept = {}
+local function keeper() for _ = 1, n do kept[#kept + 1] = {} end end
+local function churn() for _ = 1, n do local _ = {} end end
+
+local function call_field(text, line, field)
+	return tonumber(text:match("'call':'[^']*:" .. line .. "','count':%d+[^{}]-'" .. field .. "':(%d+)"))
+end
+
+local function site_live(text, line)
+	return tonumber(text:match("{'call':'[^']*:" .. line .. "','liveCount':%d+,'liveBytes':(%d+)")) or 0
+end
+
+local keeper_line = debug.getinfo(keeper, "S").linedefined
+local churn_line = debug.getinfo(churn, "S").linedefined
+local failed = 0
+for _, mode in ipairs({"hook", "vm"}) do
+	local file = string.format("%s/alloc_tags_%s.json", out_dir, mode)
+	kept = {}
+	collectgarbage()
+	profiler.start{mode = mode, calibrate = false, alloc = true, alloc_sample_kb = 4}
+	keeper()
+	churn()
+	collectgarbage()
+	profiler.dump(file)
+	local text = assert(io.open(file)):read("a")
+
+	-- the same n empty tables, whether they live or not
+	local keeper_tables = call_field(text, keeper_line, "allocTable") or 0
+	local churn_tables = call_field(text, churn_line, "allocTable") or -1
+	local churn_count = call_field(text, churn_line, "allocCount") or 0
+	local keeper_live = site_live(text, keeper_line)
+	local churn_live = site_live(text, churn_line)
+
+	kept = {}
+	collectgarbage()
+	profiler.dump(file)
+	local freed_live = site_live(assert(io.open(file)):read("a"), keeper_line)
+	profiler.stop()
+
+	local ok = keeper_tables > 0 and keeper_tables == churn_tables and keeper_tables % n == 0 and churn_count == n
+		and keeper_live >= keeper_tables / 2 and churn_live == 0 and freed_live == 0
+	print(string.format('{"alloc":"%s","tables":%d,"keeper_live":%d,"churn_live":%d,"freed_live":%d,"ok":%s}',
+		mode, keeper_tables, keeper_live, churn_live, freed_live, tostring(ok)))
+	if not ok then
+		failed = failed + 1
+	end
+end
+
+os.exit(failed == 0 and 0 or 1)
@@ -0,0 +1,60 @@
+-- heap_diff reports exactly the tables added to and dropped from a global
+-- cache between snapshots, by type and by reference path, and raises on
+-- files it cannot read. exits non zero on failure
+-- usage: LUA_CPATH="luaclib/?.so" lua test/heap_diff.lua [out_dir]
+local profiler = require "profiler.c"
+
+local out_dir = arg[1] or "/tmp"
+local n = 1000
+
+local function delta(text, key, value, field)
+	return tonumber(text:match("{'" .. key .. "':'" .. value:gsub("%p", "%%%0") .. "',[^}]-'" .. field .. "':(%-?%d+)")) or 0
+end
+
+local function diff(before, after)
+	local file = string.format("%s/heap_diff.json", out_dir)
+	profiler.heap_diff(before, after, file)
+	return assert(io.open(file)):read("a")
+end
+
+local snapshots = {}
+for i = 1, 3 do
+	snapshots[i] = string.format("%s/heap_diff_%d.snapshot", out_dir, i)
+end
+
+heap_diff_cache = {}
+local objects = {}
+objects[1] = profiler.heap_snapshot(snapshots[1])
+for i = 1, n do
+	heap_diff_cache[i] = {i}
+end
+objects[2] = profiler.heap_snapshot(snapshots[2])
+for i = n / 2 + 1, n do
+	heap_diff_cache[i] = nil
+end
+objects[3] = profiler.heap_snapshot(snapshots[3])
+
+local grown = diff(snapshots[1], snapshots[2])
+local shrunk = diff(snapshots[2], snapshots[3])
+local path = "globals.heap_diff_cache[]"
+local grown_count = delta(grown, "type", "table", "countDelta")
+local grown_path = delta(grown, "path", path, "countDelta")
+local shrunk_count = delta(shrunk, "type", "table", "countDelta")
+local shrunk_path = delta(shrunk, "path", path, "countDelta")
+local shrunk_bytes = delta(shrunk, "path", path, "shallowDelta")
+local grown_bytes = delta(grown, "path", path, "shallowDelta")
+
+local function raises(message, before, after)
+	local ok, err = pcall(profiler.heap_diff, before, after, out_dir .. "/heap_diff.json")
+	return not ok and err:find(message, 1, true) ~= nil
+end
+local missing = raises("open error", snapshots[1] .. ".missing", snapshots[2])
+local bad_format = raises("bad format", debug.getinfo(1, "S").source:sub(2), snapshots[2])
+
+local ok = objects[2] - objects[1] == n and objects[2] - objects[3] == n / 2
+	and grown_count == n and grown_path == n and shrunk_count == -n / 2 and shrunk_path == -n / 2
+	and grown_bytes > 0 and shrunk_bytes * 2 == -grown_bytes and missing and bad_format
+print(string.format('{"heap":"diff","grown":%d,"grown_path":%d,"shrunk":%d,"shrunk_path":%d,"missing":%s,"bad_format":%s,"ok":%s}',
+	grown_count, grown_path, shrunk_count, shrunk_path, tostring(missing), tostring(bad_format), tostring(ok)))
+
+os.exit(ok and 0 or 1)
@@ -0,0 +1,53 @@
+-- calls made while paused are not counted, reset zeroes the counts and the
+-- hooks are gone while paused. exits non zero on failure
+-- usage: LUA_CPATH="luaclib/?.so" lua test/pause_resume.lua [out_dir]
+local profiler = require "profiler.c"
+
+local out_dir = arg[1] or "/tmp"
+
+local function f() end
+local function calls(n)
+	for _ = 1, n do
+		f()
+	end
+end
+
+local function dump_count(file, line)
+	local text = assert(io.open(file)):read("a")
+	return tonumber(text:match("'call':'[^']*:" .. line .. "','count':(%d+)")) or 0
+end
+
+local f_line = debug.getinfo(f, "S").linedefined
+local failed = 0
+for _, mode in ipairs({"hook", "vm"}) do
+	local file = string.format("%s/pause_resume_%s.json", out_dir, mode)
+	profiler.start{mode = mode, calibrate = false, gc = false}
+	calls(10)
+	local before = profiler.record_save()
+	profiler.pause()
+	local unhooked = debug.gethook() == nil
+	calls(100)
+	profiler.resume()
+	calls(20)
+	local after = profiler.record_save()
+
+	profiler.dump(file)
+	local total = dump_count(file, f_line)
+	profiler.dump(file, before, after)
+	local window = dump_count(file, f_line)
+
+	profiler.reset()
+	calls(5)
+	profiler.dump(file)
+	local reset = dump_count(file, f_line)
+	profiler.stop()
+
+	local ok = unhooked and total == 30 and window == 20 and reset == 5
+	print(string.format('{"pause":"%s","total":%d,"window":%d,"reset":%d,"unhooked":%s,"ok":%s}',
+		mode, total, window, reset, tostring(unhooked), tostring(ok)))
+	if not ok then
+		failed = failed + 1
+	end
+end
+
+os.exit(failed == 0 and 0 or 1)
@@ -0,0 +1,109 @@
+-- record_dump windows over a small snapshot ring match the call counts made
+-- between the saves, for every retained pair: checks which snapshots the
+-- keep/stride/capacity policy retains and that deltas merged by eviction and
+-- keyframes rebuild the same counts. exits non zero on failure
+-- usage: LUA_CPATH="luaclib/?.so" lua test/record_ring.lua [out_dir]
+local profiler = require "profiler.c"
+
+local out_dir = arg[1] or "/tmp"
+local keep, stride, capacity, keyframe = 4, 3, 8, 3
+local saves = 40
+
+local function tick() end
+local function rare() end
+local function step(seq)
+	for _ = 1, seq % 5 + 1 do
+		tick()
+	end
+	-- most deltas leave rare's row out
+	if seq % 7 == 0 then
+		rare()
+	end
+end
+
+-- the seqs the ring should still hold after saves pushes
+local function retained()
+	local entries = {}
+	for seq = 0, saves - 1 do
+		entries[#entries + 1] = seq
+		if #entries > keep then
+			local pos = #entries - keep
+			if entries[pos] % stride ~= 0 then
+				table.remove(entries, pos)
+			end
+		end
+		while #entries > math.max(capacity, keep) do
+			table.remove(entries, 1)
+		end
+	end
+	return entries
+end
+
+-- calls of f made by the steps after save start and up to save stop
+local function expected(f, start, stop)
+	local count = 0
+	for seq = start + 1, stop do
+		if f == tick then
+			count = count + seq % 5 + 1
+		elseif seq % 7 == 0 then
+			count = count + 1
+		end
+	end
+	return count
+end
+
+local function dump_count(file, line)
+	local text = assert(io.open(file)):read("a")
+	return tonumber(text:match("'call':'[^']*:" .. line .. "','count':(%d+)")) or 0
+end
+
+local tick_line = debug.getinfo(tick, "S").linedefined
+local rare_line = debug.getinfo(rare, "S").linedefined
+local failed = 0
+for _, mode in ipairs({"hook", "vm"}) do
+	profiler.start{mode = mode, calibrate = false, gc = false, record_keep = keep, record_stride = stride,
+		record_capacity = capacity, record_keyframe = keyframe}
+	for seq = 0, saves - 1 do
+		step(seq)
+		assert(profiler.record_save() == seq)
+	end
+
+	local want = retained()
+	local list = profiler.record_list()
+	local ok = #list == #want
+	for i, entry in ipairs(list) do
+		ok = ok and entry.seq == want[i]
+	end
+	print(string.format('{"ring":"retain","mode":"%s","retained":%d,"ok":%s}', mode, #list, tostring(ok)))
+	if not ok then
+		failed = failed + 1
+	end
+
+	-- -1 starts from zero, which counts step 0 as well
+	local starts = {-1}
+	for _, seq in ipairs(want) do
+		starts[#starts + 1] = seq
+	end
+	local windows, bad = 0, 0
+	local file = string.format("%s/record_ring_%s.json", out_dir, mode)
+	for i = 1, #starts do
+		for j = i + 1, #starts do
+			local start, stop = starts[i], starts[j]
+			profiler.dump(file, start, stop)
+			windows = windows + 1
+			if dump_count(file, tick_line) ~= expected(tick, start, stop)
+				or dump_count(file, rare_line) ~= expected(rare, start, stop) then
+				bad = bad + 1
+			end
+		end
+	end
+	profiler.stop()
+
+	print(string.format('{"ring":"windows","mode":"%s","windows":%d,"bad":%d,"ok":%s}',
+		mode, windows, bad, tostring(bad == 0)))
+	if bad ~= 0 then
+		failed = failed + 1
+	end
+end
+
+os.exit(failed == 0 and 0 or 1)
@@ -0,0 +1,62 @@
+-- tail calls keep their depth after luaE_shrinkCI drops unused CallInfos,
+-- which a collection or a caught error does. exits non zero on failure
+-- usage: LUA_CPATH="luaclib/?.so" lua test/shrink_ci.lua [out_dir]
+local profiler = require "profiler.c"
+
+local out_dir = arg[1] or "/tmp"
+local loops = 1000
+local n = 1000
+
+local function leaf(count) local s = 0 for i = 1, count do s = s + i end return s end
+local function tail(count) return leaf(count) end
+local function deep(depth) if depth > 0 then return 1 + deep(depth - 1) end return 0 end
+local function fail(depth) if depth > 0 then return 1 + fail(depth - 1) end error("x") end
+
+
+-- function header of the line report: "name source:linedefined self ms percent% hits count"
+local function report(file)
+	local result = {}
+	for line in io.lines(file) do
+		local linedefined, percent, hits = line:match("^%S+ %S-:(%d+) self [%d.]+ ms ([%d.]+)%% hits (%d+)$")
+		if linedefined then
+			result[tonumber(linedefined)] = {percent = tonumber(percent), hits = tonumber(hits)}
+		end
+	end
+	return result
+end
+
+local leaf_line = debug.getinfo(leaf, "S").linedefined
+local tail_line = debug.getinfo(tail, "S").linedefined
+local failed = 0
+for _, mode in ipairs({"hook", "vm"}) do
+	for _, name in ipairs({"gc", "pcall"}) do
+		-- from the level tail is called at, so the freed CallInfos are the
+		-- ones tail and leaf run in next
+		if name == "gc" then
+			deep(50)
+			collectgarbage()
+		else
+			pcall(fail, 50)
+		end
+		profiler.start{mode = mode, line = true, calibrate = false}
+		for _ = 1, loops do
+			tail(n)
+		end
+		local file = string.format("%s/shrink_ci_%s_%s.txt", out_dir, name, mode)
+		profiler.line_dump(file)
+		profiler.stop()
+
+		local lines = report(file)
+		local l = lines[leaf_line] or {percent = 0, hits = 0}
+		local t = lines[tail_line] or {percent = 0, hits = 0}
+		-- the for loop hits its line once per iteration and once to leave
+		local ok = l.hits == loops * (n + 1) and t.hits == loops and l.percent > 90
+		print(string.format('{"shrink":"%s","mode":"%s","leaf_hits":%d,"leaf_percent":%.2f,"tail_hits":%d,"ok":%s}',
+			name, mode, l.hits, l.percent, t.hits, tostring(ok)))
+		if not ok then
+			failed = failed + 1
+		end
+	end
+end
+
+os.exit(failed == 0 and 0 or 1)